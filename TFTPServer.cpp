@@ -22,12 +22,16 @@
  *
  * Minimal TFTP Server
  *      * Receive and send files via TFTP
- *      * Server handles only one transfer at a time
- *      * Supports only octet (raw 8 bit bytes) mode transfers
- *      * fixed block size: 512 bytes
+ *      * Handles up to MaxSessions transfers at a time
+ *      * Supports octet (raw 8 bit bytes) and netascii mode transfers
+ *      * Negotiates blksize (RFC 2348) and windowsize (RFC 7440)
+ *      * Negotiates tsize (RFC 2349) on uploads to reject them early
+ *      * Concurrent readers of the same file share a window of blocks
+ *      * Storage access optionally runs in a ThreadTFTPStorage
  *
  */
 #include "TFTPServer.h"
+#include "threadTFTPStorage.h"
 
 //#define DEBUG_TFTP
 #ifdef DEBUG_TFTP
@@ -37,22 +41,116 @@
 #endif
 
 /**
- * @brief   Creates a new TFTP server listening on myPort.
+ * @brief   Gets current time for storage statistics and timeouts.
  * @note
- * @param   net  A pointer to EthernetInterface object.
- * @param   port A port to listen on (defaults to 69).
+ * @param
+ * @retval  Milliseconds since boot.
+ */
+static uint32_t ioTime()
+{
+    return Kernel::Clock::now().time_since_epoch().count();
+}
+
+/**
+ * @brief   Creates a new TFTP server on storage provided by the derived class.
+ * @note    The storage is not constructed yet, it must not be accessed here.
+ * @param   sessions      Session table.
+ * @param   maxSessions   Number of entries in the session table.
+ * @param   blockPool     maxSessions * maxWindow * (4 + maxBlockSize) bytes.
+ * @param   maxBlockSize  Largest block size accepted.
+ * @param   maxWindow     Largest window size accepted.
+ * @param   rxBuff        4 + maxBlockSize + 2 bytes.
+ * @param   windows         Shared read window table.
+ * @param   maxWindows      Number of entries in the shared window table.
+ * @param   sharedPool      maxWindows * sharedPoolSize bytes.
+ * @param   sharedPoolSize  Bytes of blocks per shared window.
+ * @param   ioPool          Storage request pool.
+ * @param   ioPoolSize      Number of entries in the storage request pool.
+ * @retval
+ */
+TFTPServerBase::TFTPServerBase(Session* sessions, int maxSessions,
+                               char* blockPool, int maxBlockSize, int maxWindow,
+                               char* rxBuff,
+                               SharedWindow* windows, int maxWindows,
+                               char* sharedPool, int sharedPoolSize,
+                               IORequest* ioPool, int ioPoolSize) :
+    net(nullptr),
+    port(TFTP_PORT),
+    state(DELETED),
+    sessions(sessions),
+    maxSessions(maxSessions),
+    blockPool(blockPool),
+    maxBlockSize(maxBlockSize),
+    maxWindow(maxWindow),
+    rxBuff(rxBuff),
+    windows(windows),
+    maxWindows(maxWindows),
+    sharedPool(sharedPool),
+    sharedPoolSize(sharedPoolSize),
+    ioPool(ioPool),
+    ioPoolSize(ioPoolSize),
+    storage(nullptr),
+    eventQueue(NULL),
+    progressBlocks(0),
+    targetCount(0),
+    lastSession(NULL),
+    fileCounter(0)
+{
+    memset(&ioStats, 0, sizeof(ioStats));
+}
+
+/**
+ * @brief   Destroys this instance of the TFTP server.
+ * @note    The session table and request pool belong to the derived class
+ *          and are destroyed already, its destructor calls close().
+ * @param
  * @retval
  */
-TFTPServer::TFTPServer(NetworkInterface* net, uint16_t myPort /* = 69 */ )
+TFTPServerBase::~TFTPServerBase()
+{
+}
+
+/**
+ * @brief   Opens the socket and starts listening on myPort.
+ * @note    Reopens a server that is open already, aborting its transfers.
+ * @param   net     A pointer to EthernetInterface object.
+ * @param   myPort  A port to listen on (defaults to 69).
+ * @retval  0 on success, negative error code otherwise.
+ */
+int TFTPServerBase::open(NetworkInterface* net, uint16_t myPort /* = 69 */ )
 {
+    close();    // already opened, e.g. by the constructor
+
+    this->net = net;
     port = myPort;
     DEBUG_TFTP("TFTPServer(): port=%d\r\n", myPort);
 
-    socket = new UDPSocket();
-    socket->open(net);
-    
+    for (int i = 0; i < maxSessions; i++) {
+        sessions[i].state = LISTENING;
+        sessions[i].file = NULL;
+        sessions[i].shared = NULL;
+        sessions[i].target = NULL;
+        sessions[i].ioPending = 0;
+        sessions[i].blockBuff = &blockPool[i * maxWindow * (4 + maxBlockSize)];
+    }
+
+    for (int i = 0; i < maxWindows; i++) {
+        windows[i].refs = 0;
+        windows[i].ioPending = 0;
+        windows[i].file = NULL;
+        windows[i].blocks = &sharedPool[i * sharedPoolSize];
+    }
+
+    for (int i = 0; i < ioPoolSize; i++)
+        ioPool[i].inUse = false;
+
+    int err = socket.open(net);
+
     state = LISTENING;
-    if (socket->bind(port))
+    if (err == 0)
+        err = socket.bind(port);
+
+    if (err)
     {
         socketAddr = SocketAddress(0, port);
         state = ERROR;
@@ -60,55 +158,89 @@ TFTPServer::TFTPServer(NetworkInterface* net, uint16_t myPort /* = 69 */ )
 
     DEBUG_TFTP("FTP server state = %d\r\n", getState());
 
-    socket->set_blocking(true);
+    socket.set_blocking(true);
 
     fileCounter = 0;
+    return err;
 }
 
 /**
- * @brief   Destroys this instance of the TFTP server.
- * @note
+ * @brief   Resets the TFTP server.
+ * @note    Aborts all transfers in progress.
  * @param
  * @retval
  */
-TFTPServer::~TFTPServer()
+void TFTPServerBase::reset()
 {
-    socket->close();
-    delete(socket);
-    state = DELETED;
+    for (int i = 0; i < maxSessions; i++) {
+        if (sessions[i].state != LISTENING)
+        {
+            notify(&sessions[i], Event::FAILED, ERR_UNDEFINED, "Server reset");
+            abortSession(&sessions[i], NULL);   // removes partial uploads
+        }
+    }
+
+    socket.close();
+    state = LISTENING;
+    if (socket.open(net) || socket.bind(port))
+    {
+        socketAddr.set_port(port);
+        state = ERROR;
+    }
+
+    socket.set_blocking(true);
+    fileNameMutex.lock();
+    lastSession = NULL;
+    fileNameMutex.unlock();
+    fileCounter = 0;
 }
 
 /**
- * @brief   Resets the TFTP server.
- * @note
+ * @brief   Aborts all transfers and closes the socket.
+ * @note    Waits for outstanding storage requests, they refer to this object.
+ *          Call open() to start again.
  * @param
  * @retval
  */
-void TFTPServer::reset()
+void TFTPServerBase::close()
 {
-    socket->close();
-    delete(socket);
-    socket = new UDPSocket();
-    state = LISTENING;
-    if (socket->bind(port))
-    {
-        socketAddr.set_port(port);
-        state = ERROR;
+    if (state == DELETED)
+        return;     // never opened, the session table is not initialized
+
+    for (int i = 0; i < maxSessions; i++) {
+        if (sessions[i].state != LISTENING)
+        {
+            notify(&sessions[i], Event::FAILED, ERR_UNDEFINED, "Server closed");
+            abortSession(&sessions[i], NULL);   // removes partial uploads
+        }
     }
 
-    socket->set_blocking(true);
-    strcpy(fileName, "");
-    fileCounter = 0;
+    while ((storage != NULL) && (ioStats.pending > 0)) {
+        IORequest*  req = storage->getCompleted(TFTP_IO_POLL_MS);
+        if (req != NULL)
+            completeIO(req);
+    }
+
+    socket.close();
+    state = DELETED;
 }
 
 /**
  * @brief   Gets current TFTP status.
- * @note
+ * @note    While listening, returns the state of the first transfer in progress.
  * @param
  * @retval
  */
-TFTPServer::State TFTPServer::getState()
+TFTPServerBase::State TFTPServerBase::getState()
 {
+    if (state != LISTENING)
+        return state;
+
+    for (int i = 0; i < maxSessions; i++) {
+        if (sessions[i].state != LISTENING)
+            return sessions[i].state;
+    }
+
     return state;
 }
 
@@ -118,7 +250,7 @@ TFTPServer::State TFTPServer::getState()
  * @param
  * @retval
  */
-void TFTPServer::suspend()
+void TFTPServerBase::suspend()
 {
     state = SUSPENDED;
 }
@@ -129,7 +261,7 @@ void TFTPServer::suspend()
  * @param
  * @retval
  */
-void TFTPServer::resume()
+void TFTPServerBase::resume()
 {
     if (state == SUSPENDED)
         state = LISTENING;
@@ -137,216 +269,282 @@ void TFTPServer::resume()
 
 /**
  * @brief   Polls for data or new connection.
- * @note
+ * @note    While storage requests are outstanding the socket waits at most
+ *          TFTP_IO_POLL_MS, so completions are picked up promptly.
  * @param
  * @retval
  */
-void TFTPServer::poll()
+void TFTPServerBase::poll()
 {
+    processCompletions();
+
     if ((state == SUSPENDED) || (state == DELETED) || (state == ERROR))
         return;
 
-    char    buff[516];
-    int     len = socket->recvfrom(&socketAddr, buff, sizeof(buff));
+    char*   buff = rxBuff;
+
+    int     timeout = checkTimeouts();
 
-    if (len <= 0)
+    if ((ioStats.pending > 0) && ((timeout < 0) || (timeout > TFTP_IO_POLL_MS)))
+        timeout = TFTP_IO_POLL_MS;
+    socket.set_timeout(timeout);
+    // one byte more than the largest block so that oversized DATA shows
+    int     len = socket.recvfrom(&socketAddr, buff, 4 + maxBlockSize + 1);
+
+    if (len < 2)
         return;
 
+    buff[len] = '\0';   // guard for string fields
+
     DEBUG_TFTP("Got block with size %d.\n\r", len);
 
-    switch (state) {
-        case LISTENING:
+    Session*    s = findSession();
+    if (s != NULL)
+    {
+        handleSession(s, buff, len);
+        return;
+    }
+
+    switch (buff[1]) {
+        case 0x01:          // RRQ
+            connectRead(buff, len);
+            break;
+
+        case 0x02:          // WRQ
+            connectWrite(buff, len);
+            break;
+
+        case 0x03:          // DATA before connection established
+            sendError("No data expected.\r\n", ERR_UNKNOWN_TID);
+            break;
+
+        case 0x04:          // ACK before connection established
+            sendError("No ack expected.\r\n", ERR_UNKNOWN_TID);
+            break;
+
+        case 0x05:          // ERROR packet received
+            DEBUG_TFTP("TFTP Error received.\r\n");
+            break;
+
+        default:            // unknown TFTP packet type
+            sendError("Unknown TFTP packet type.\r\n", ERR_ILLEGAL_OP);
+            break;
+    }                       // switch buff[1]
+}
+
+/**
+ * @brief   Dispatches a packet received from a connected remote client.
+ * @note
+ * @param   s     Session of the remote client.
+ * @param   buff  Received packet.
+ * @param   len   Received packet size.
+ * @retval
+ */
+void TFTPServerBase::handleSession(Session* s, char* buff, int len)
+{
+    if (((buff[1] == 0x03) || (buff[1] == 0x04)) && (len < 4))
+        return;     // truncated DATA or ACK, no block number
+
+    s->lastActivity = ioTime();
+
+    uint16_t    block = ((uint8_t)buff[2] << 8) | (uint8_t)buff[3];
+
+    switch (s->state) {
+        case READING:
             {
                 switch (buff[1]) {
-                    case 0x01:          // RRQ
-                        connectRead(buff);
-                        break;
+                    case 0x01:
+                        // if this is the receiving host, send first packets again
+                        if (s->started && (s->blockAcked == 0))
+                        {
+                            if (s->oackPending)
+                                socket.sendto(s->remoteAddr, s->blockBuff, s->oackSize);
+                            else
+                                for (uint32_t n = 1; n <= s->blockSent; n++)
+                                    sendBlock(s, n);
+                            s->dupCounter++;
+                        }
 
-                    case 0x02:          // WRQ
-                        connectWrite(buff);
+                        if (s->dupCounter > 10)
+                        {           // too many dups, stop sending
+                            abortSession(s, "Too many dups");
+                        }
                         break;
 
-                    case 0x03:          // DATA before connection established
-                        sendError("No data expected.\r\n");
+                    case 0x02:
+                        // this should never happen, ignore
+                        abortSession(s, "WRQ received on open read socket", ERR_ILLEGAL_OP);
                         break;
 
-                    case 0x04:          // ACK before connection established
-                        sendError("No ack expected.\r\n");
+                    case 0x03:
+                        // we are the sending side, ignore
+                        abortSession(s, "Received data package on sending socket", ERR_ILLEGAL_OP);
                         break;
 
-                    case 0x05:          // ERROR packet received
-                        DEBUG_TFTP("TFTP Error received.\r\n");
-                        break;
+                    case 0x04:
+                        {
+                            // blocks up to n received, send next if there is one
+                            int16_t     diff = (int16_t)(block - (uint16_t)s->blockAcked);
+                            uint32_t    n = s->blockAcked + diff;
 
-                    default:            // unknown TFTP packet type
-                        sendError("Unknown TFTP packet type.\r\n");
-                        break;
-                }                       // switch buff[1]
-                break;                  // case listening
-            }
+                            if (!s->started || (diff < 0) || (n > s->blockSent))
+                                break;  // stale or bogus ACK
 
-        case READING:
-            {
-                if (cmpHost())
-                {
-                    switch (buff[1]) {
-                        case 0x01:
-                            // if this is the receiving host, send first packet again
-                            if (blockCounter == 1)
+                            s->oackPending = false;
+                            if (diff > 0)
                             {
-                                ack(0);
-                                dupCounter++;
-                            }
+                                uint32_t    from = s->blockAcked;
 
-                            if (dupCounter > 10)
-                            {           // too many dups, stop sending
-                                sendError("Too many dups");
-                                fclose(file);
-                                state = LISTENING;
-                                remoteAddr.set_ip_address("");
+                                s->blockAcked = n;
+                                s->dupCounter = 0;
+                                notifyProgress(s, from, n);
                             }
-                            break;
-
-                        case 0x02:
-                            // this should never happen, ignore
-                            sendError("WRQ received on open read socket");
-                            fclose(file);
-                            state = LISTENING;
-                            remoteAddr.set_ip_address("");
-                            break;
-
-                        case 0x03:
-                            // we are the sending side, ignore
-                            sendError("Received data package on sending socket");
-                            fclose(file);
-                            state = LISTENING;
-                            remoteAddr.set_ip_address("");
-                            break;
-
-                        case 0x04:
-                            // last packet received, send next if there is one
-                            dupCounter = 0;
-                            if (blockSize == 516)
-                            {
-                                getBlock();
-                                sendBlock();
+                            else if (n < s->blockSent)
+                            {           // duplicate ACK, window got lost
+                                if (++s->dupCounter > 10)
+                                {
+                                    abortSession(s, "Too many dups");
+                                    break;
+                                }
                             }
-                            else
+
+                            if (s->eof && (s->blockAcked == s->blockSent))
                             {           //EOF
-                                fclose(file);
-                                state = LISTENING;
-                                remoteAddr.set_ip_address("");
+                                notify(s, Event::COMPLETED);
+                                closeSession(s);
+                                break;
                             }
-                            break;
 
-                        default:        // this includes 0x05 errors
-                            sendError("Received 0x05 error message");
-                            fclose(file);
-                            state = LISTENING;
-                            remoteAddr.set_ip_address("");
+                            // resend the rest of a partially received window
+                            for (uint32_t i = n + 1; i <= s->blockSent; i++)
+                                sendBlock(s, i);
+                            fillWindow(s);
                             break;
-                    }                   // switch (buff[1])
-                }
-                else {
-                    DEBUG_TFTP("Ignoring package from other remote client during RRQ.\r\n");
-                }
-                break;                  // reading
+                        }
+
+                    default:        // this includes 0x05 errors
+                        DEBUG_TFTP("Received 0x05 error message\r\n");
+                        notify(s, Event::FAILED, (uint8_t)buff[3], "Aborted by client");
+                        closeSession(s);
+                        break;
+                }                   // switch (buff[1])
+                break;              // reading
             }
 
         case WRITING:
             {
-                if (cmpHost())
-                {
-                    switch (buff[1]) {
-                        case 0x02:
+                switch (buff[1]) {
+                    case 0x02:
+                        {
+                            // if this is a returning host, send ack/oack again
+                            if ((s->file == NULL) && (s->target == NULL))
+                                break;  // still opening
+                            if (s->oackPending)
+                                socket.sendto(s->remoteAddr, s->blockBuff, s->oackSize);
+                            else if (s->blockSent == 0)
+                                ack(s, 0);
+                            DEBUG_TFTP("Resending Ack on WRQ.\r\n");
+                            break;  // case 0x02
+                        }
+
+                    case 0x03:
+                        {
+                            int16_t diff = (int16_t)(block - (uint16_t)s->blockSent);
+                            if (len > 4 + s->blkSize)
                             {
-                                // if this is a returning host, send ack again
-                                ack(0);
-                                DEBUG_TFTP("Resending Ack on WRQ.\r\n");
-                                break;  // case 0x02
+                                abortSession(s, "Block larger than negotiated", ERR_ILLEGAL_OP);
                             }
-
-                        case 0x03:
+                            else if (s->closing)
+                            {
+                                // final block is being stored, ACK follows
+                            }
+                            else if ((diff == 1) && (s->blockSent + 1 - s->blockAcked <= s->windowSize))
                             {
-                                int block = (buff[2] << 8) + buff[3];
-                                if ((blockCounter + 1) == block)
+                                // new packet, buffered until written
+                                s->oackPending = false;
+                                s->blockSent++;
+                                s->dupCounter = 0;
+                                if (len < 4 + s->blkSize)
                                 {
-                                    ack(block);
-                                    // new packet
-                                    char*   data = &buff[4];
-                                    fwrite(data, 1, len - 4, file);
-                                    blockCounter++;
-                                    dupCounter = 0;
-                                }
-                                else
-                                {       // mismatch in block nr
-                                    if ((blockCounter + 1) < block)
-                                    {   // too high
-                                        sendError("Packet count mismatch");
-                                        fclose(file);
-                                        state = LISTENING;
-                                        remove(fileName);
-                                        remoteAddr.set_ip_address("");
-                                    }
-                                    else
-                                    {   // duplicate packet, send ACK again
-                                        if (dupCounter > 10)
-                                        {
-                                            sendError("Too many dups");
-                                            fclose(file);
-                                            remove(fileName);
-                                            state = LISTENING;
-                                        }
-                                        else
-                                        {
-                                            ack(blockCounter);
-                                            dupCounter++;
-                                        }
-                                    }
+                                    s->eof = true;
+                                    s->lastSize = len;
                                 }
+                                memcpy(blockSlot(s, s->blockSent), buff, len);
 
-                                if (len < 516)
+                                if (s->eof || (s->blockSent - s->blockAcked >= s->windowSize))
+                                    s->ackDue = true;
+                                writeNext(s);
+                                checkAck(s);
+                            }
+                            else if ((diff > 1) && (s->windowSize == 1))
+                            {       // too high
+                                abortSession(s, "Packet count mismatch");
+                            }
+                            else if (!s->ackDue)
+                            {       // duplicate or out of window, send ACK again
+                                if (s->dupCounter > 10)
+                                {
+                                    abortSession(s, "Too many dups");
+                                }
+                                else
                                 {
-                                    ack(blockCounter);
-                                    fclose(file);
-                                    state = LISTENING;
-                                    remoteAddr.set_ip_address("");
-                                    fileCounter++;
-                                    DEBUG_TFTP("File receive finished.\r\n");
+                                    ack(s, s->blockWritten);
+                                    s->dupCounter++;
                                 }
-                                break;  // case 0x03
                             }
+                            break;  // case 0x03
+                        }
 
-                        default:
-                            {
-                                sendError("No idea why you're sending me this!");
-                                break;  // default
-                            }
-                    }                   // switch (buff[1])
-                }
-                else {
-                    DEBUG_TFTP("Ignoring packege from other remote client during WRQ.\r\n");
-                }
-                break;                  // writing
+                    case 0x05:
+                        {
+                            DEBUG_TFTP("Received 0x05 error message\r\n");
+                            notify(s, Event::FAILED, (uint8_t)buff[3], "Aborted by client");
+                            abortSession(s, NULL);
+                            break;
+                        }
+
+                    default:
+                        {
+                            sendError("No idea why you're sending me this!", ERR_ILLEGAL_OP);
+                            break;  // default
+                        }
+                }                   // switch (buff[1])
+                break;              // writing
             }
 
-        case ERROR:
-        case SUSPENDED:
-        case DELETED:
         default:
             { }
-    }                                   // state
+    }                               // state
 }
 
 /**
  * @brief   Gets the file name during read and write.
- * @note
+ * @note    name must hold TFTP_MAX_FILENAME chars.
+ * @param   name  A pointer to C-style string to be filled with file name.
+ * @retval
+ */
+void TFTPServerBase::getFileName(char* name)
+{
+    getFileName(name, TFTP_MAX_FILENAME);
+}
+
+/**
+ * @brief   Gets the file name during read and write.
+ * @note    Safe to call from another thread while poll() runs, but the name
+ *          may already belong to the next transfer. Use attach() to get the
+ *          name together with the transfer it belongs to.
  * @param   name  A pointer to C-style string to be filled with file name.
+ * @param   size  Size of name, the file name is truncated to fit.
  * @retval
  */
-void TFTPServer::getFileName(char* name)
+void TFTPServerBase::getFileName(char* name, size_t size)
 {
-    sprintf(name, "%s", fileName);
+    if (size == 0)
+        return;
+
+    fileNameMutex.lock();
+    snprintf(name, size, "%s", (lastSession != NULL) ? lastSession->fileName : "");
+    fileNameMutex.unlock();
 }
 
 /**
@@ -355,52 +553,152 @@ void TFTPServer::getFileName(char* name)
  * @param
  * @retval
  */
-int TFTPServer::fileCount()
+int TFTPServerBase::fileCount()
 {
     return fileCounter;
 }
 
+/**
+ * @brief   Returns number of transfers in progress.
+ * @note
+ * @param
+ * @retval
+ */
+int TFTPServerBase::activeSessions()
+{
+    int count = 0;
+
+    for (int i = 0; i < maxSessions; i++) {
+        if (sessions[i].state != LISTENING)
+            count++;
+    }
+
+    return count;
+}
+
+/**
+ * @brief   Issues storage requests to an I/O thread.
+ * @note    The thread must serve this server only.
+ *          Switch before open() or while no transfer is in progress.
+ * @param   storage  Started I/O thread, NULL to execute requests inline.
+ * @retval
+ */
+void TFTPServerBase::setStorage(ThreadTFTPStorage* storage)
+{
+    this->storage = storage;
+}
+
+/**
+ * @brief   Gets storage wait statistics.
+ * @note    A growing maxWaitMs points at file system stalls.
+ * @param
+ * @retval
+ */
+TFTPServerBase::IOStats TFTPServerBase::getIOStats()
+{
+    return ioStats;
+}
+
+/**
+ * @brief   Reports transfer events.
+ * @note    Events are posted to queue so the transfers go on while the
+ *          handler runs. A posted event takes sizeof(Event) bytes of the
+ *          queue, it is dropped if the queue is full.
+ *          Without a queue the handler is called from poll() and must not block.
+ *          FAILED is reported without STARTED if the file could not be opened.
+ *          Attach before open() or while no transfer is in progress.
+ * @param   handler         Event handler.
+ * @param   queue           Queue dispatched by the application, or NULL.
+ * @param   progressBlocks  Blocks between PROGRESS events, 0: no PROGRESS events.
+ * @retval
+ */
+void TFTPServerBase::attach(EventHandler handler, EventQueue* queue, uint32_t progressBlocks)
+{
+    eventHandler = handler;
+    eventQueue = queue;
+    this->progressBlocks = progressBlocks;
+}
+
+/**
+ * @brief   Streams uploads of a reserved name straight into a block device.
+ * @note    A WRQ for name programs the DATA blocks into the region as they
+ *          arrive, no file system is involved. Sectors are erased at least
+ *          one sector ahead of the block being programmed and the final ACK
+ *          is sent once the device is synced. Block sizes are negotiated down to a multiple of
+ *          the program size so blocks are programmed from the receive window.
+ *          A failed upload leaves the region partially written, watch for
+ *          the FAILED event. Only one upload per name runs at a time.
+ *          Register before open().
+ * @param   name  Reserved file name, must stay valid.
+ * @param   bd    Initialized block device.
+ * @param   addr  Region start, aligned to the erase size.
+ * @param   size  Region size, a multiple of the erase size.
+ * @retval  0 on success, negative error code otherwise.
+ */
+int TFTPServerBase::addBlockDevice(const char* name, BlockDevice* bd, bd_addr_t addr, bd_size_t size)
+{
+    if (targetCount >= TFTP_MAX_BLOCKDEVICES)
+        return -ENOMEM;
+
+    if ((name == NULL) || (bd == NULL) || (size == 0) || !bd->is_valid_erase(addr, size)
+     || (TFTP_DEFAULT_BLKSIZE % bd->get_program_size() != 0))
+        return -EINVAL;
+
+    BlockTarget*    t = &targets[targetCount++];
+
+    t->name = name;
+    t->bd = bd;
+    t->addr = addr;
+    t->size = size;
+    t->session = NULL;
+    return 0;
+}
+
 /**
  * @brief   Creates a new connection reading a file from server.
  * @note    Sends the file to the remote client.
  *          Sends en error message to the remote client in case of failure.
  * @param   buff  A char array to pass data.
+ * @param   len   Request size.
  * @retval
  */
-void TFTPServer::connectRead(char* buff)
+void TFTPServerBase::connectRead(char* buff, int len)
 {
-    blockCounter = 0;
-    dupCounter = 0;
-    remoteAddr = socketAddr;
-
-    sprintf(fileName, "%s", &buff[2]);
+    Session*    s = allocSession();
+    bool        octet;
 
-    if (modeOctet(buff))
-        file = fopen(fileName, "rb");
-    else
-        file = fopen(fileName, "r");
+    if (s == NULL)
+    {
+        sendError("Server busy.\r\n");
+        return;
+    }
 
-    if (!file)
+    if (!parseRequest(s, buff, len, &octet))
     {
-        state = LISTENING;
+        sendError("Malformed request.\r\n", ERR_ILLEGAL_OP);
+        return;
+    }
+
+    s->state = READING;
+    DEBUG_TFTP("Listening: Requested file %s from TFTP connection %s port %d\r\n",
+        s->fileName,
+        s->remoteAddr.get_ip_address(),
+        s->remoteAddr.get_port()
+    );
 
-        char    msg[123] = { "Could not read file: " };
+    if (octet)
+        attachShared(s);
 
-        strcat(msg, fileName);
-        strcat(msg, "\r\n");
-        sendError(msg);
+    if (s->shared == NULL)
+    {
+        IORequest*  req = allocIO(IORequest::OPEN, s, NULL);
+        req->name = s->fileName;
+        req->mode = octet ? "rb" : "r";
+        submitIO(req);
     }
-    else
+    else if (s->shared->file != NULL)
     {
-        // file ready for reading
-        state = READING;
-        DEBUG_TFTP("Listening: Requested file %s from TFTP connection %s port %d\r\n",
-            fileName,
-            remoteAddr.get_ip_address(),
-            remoteAddr.get_port()
-        );
-        getBlock();
-        sendBlock();
+        startRead(s);
     }
 }
 
@@ -409,122 +707,1333 @@ void TFTPServer::connectRead(char* buff)
  * @note    Sends the file to the TFTP server.
  *          Sends error message to the remote client in case of failure.
  * @param   buff  A char array to pass data.
+ * @param   len   Request size.
  * @retval
  */
-void TFTPServer::connectWrite(char* buff)
+void TFTPServerBase::connectWrite(char* buff, int len)
 {
-    ack(0);
-    blockCounter = 0;
-    dupCounter = 0;
-    remoteAddr = socketAddr;
+    Session*    s = allocSession();
+    bool        octet;
 
-    sprintf(fileName, "%s", &buff[2]);
+    if (s == NULL)
+    {
+        sendError("Server busy.\r\n");
+        return;
+    }
 
-    if (modeOctet(buff))
-        file = fopen(fileName, "wb");
-    else
-        file = fopen(fileName, "w");
+    if (!parseRequest(s, buff, len, &octet))
+    {
+        sendError("Malformed request.\r\n", ERR_ILLEGAL_OP);
+        return;
+    }
 
-    if (file == NULL)
+    s->state = WRITING;
+    if (s->target != NULL)
     {
-        int err = errno;
-        printf("Could not open file to write, error: %d\n", err);
-        sendError("Could not open file to write.\n");
-        state = LISTENING;
-        remoteAddr.set_ip_address("");
+        const char* msg = NULL;
+        int         code = ERR_UNDEFINED;
+
+        if (s->target->session != NULL)
+        {
+            s->target = NULL;   // held by the upload in progress
+            msg = "Upload in progress.\r\n";
+            code = ERR_ACCESS;
+        }
+        else if (s->tsize > s->target->size)
+        {
+            snprintf(errorBuff, sizeof(errorBuff), "File too large: %lu bytes\r\n", (unsigned long)s->tsize);
+            msg = errorBuff;
+            code = ERR_DISK_FULL;
+        }
+
+        if (msg != NULL)
+        {
+            notify(s, Event::FAILED, code, msg);
+            sendError(s->remoteAddr, msg, code);
+            closeSession(s);
+            return;
+        }
     }
-    else
+
+    DEBUG_TFTP("Listening: Incoming file %s on TFTP connection from %s clientPort %d\r\n",
+        s->fileName,
+        s->remoteAddr.get_ip_address(),
+        s->remoteAddr.get_port()
+    );
+
+    if (s->target != NULL)
     {
-        // file ready for writing
-        blockCounter = 0;
-        state = WRITING;
-        DEBUG_TFTP("Listening: Incoming file %s on TFTP connection from %s clientPort %d\r\n",
-            fileName,
-            remoteAddr.get_ip_address(),
-            remoteAddr.get_port()
-        );
+        // no file to open, erase the first window while the client sends it
+        s->target->session = s;
+        streamNext(s);
+        if (s->oackPending)
+            socket.sendto(s->remoteAddr, s->blockBuff, s->oackSize);
+        else
+            ack(s, 0);
+        notify(s, Event::STARTED);
+        return;
     }
+
+    IORequest*  req = allocIO(IORequest::OPEN, s, NULL);
+    req->name = s->fileName;
+    req->mode = octet ? "wb" : "w";
+    req->size = s->tsize;
+    submitIO(req);
 }
 
 /**
- * @brief   Gets DATA block from file on disk into memory.
+ * @brief   Parses RRQ/WRQ and prepares the session.
+ * @note    Accepted options are answered with an OACK kept at blockBuff.
+ * @param   s      Session to prepare.
+ * @param   buff   Request packet, NUL terminated at buff[len].
+ * @param   len    Request size.
+ * @param   octet  Set if the transfer mode is octet.
+ * @retval  false if the request is malformed.
+ */
+bool TFTPServerBase::parseRequest(Session* s, char* buff, int len, bool* octet)
+{
+    char*   end = &buff[len];
+    bool    wrq = (buff[1] == 0x02);
+    char*   name = &buff[2];
+    int     nameLen = strlen(name);
+
+    if ((name + nameLen >= end) || (nameLen == 0) || (nameLen >= TFTP_MAX_FILENAME))
+        return false;
+
+    s->remoteAddr = socketAddr;
+    s->file = NULL;
+    s->shared = NULL;
+    s->blockSent = 0;
+    s->blockAcked = 0;
+    s->blockWritten = 0;
+    s->tsize = 0;
+    s->dupCounter = 0;
+    s->blkSize = TFTP_DEFAULT_BLKSIZE;
+    s->windowSize = 1;
+    s->lastSize = 0;
+    s->eof = false;
+    s->oackPending = false;
+    s->oackSize = 0;
+    s->started = false;
+    s->filling = false;
+    s->ackDue = false;
+    s->closing = false;
+    s->removeAfterOpen = false;
+    s->target = wrq ? findTarget(name) : NULL;
+    s->erased = 0;
+    s->erasing = false;
+    s->programming = false;
+    s->startTime = ioTime();
+    s->lastActivity = s->startTime;
+    fileNameMutex.lock();
+    strcpy(s->fileName, name);
+    lastSession = s;
+    fileNameMutex.unlock();
+
+    *octet = modeOctet(buff);
+
+    enum { OPT_BLKSIZE = 1, OPT_WINDOWSIZE = 2, OPT_TSIZE = 4 };
+
+    char*   oack = s->blockBuff;
+    int     oackLen = 2;
+    int     oackMax = maxWindow * (4 + maxBlockSize);
+    int     seen = 0;           // options accepted, repeats are ignored
+    char*   opt = name + nameLen + 1;
+
+    opt += strlen(opt) + 1;     // skip mode
+    while (opt < end) {
+        char*   val = opt + strlen(opt) + 1;
+        if (val >= end)
+            break;
+
+        unsigned long long  n = strtoull(val, NULL, 10);
+        unsigned long       accepted = 0;
+        int                 option = 0;
+
+        if ((val[0] < '0') || (val[0] > '9'))
+        {
+            // negative or not a number, strtoull would wrap it
+        }
+        else
+        if ((strcasecmp(opt, "blksize") == 0) && (n >= 8))
+        {
+            accepted = (n > (unsigned)maxBlockSize) ? maxBlockSize : n;
+            if (s->target != NULL)
+                accepted -= accepted % s->target->bd->get_program_size();
+            if (accepted > 0)
+                option = OPT_BLKSIZE;   // else smaller than a program unit, ignore the option
+        }
+        else
+        if ((strcasecmp(opt, "windowsize") == 0) && (n >= 1))
+        {
+            accepted = (n > (unsigned)maxWindow) ? maxWindow : n;
+            option = OPT_WINDOWSIZE;
+        }
+        else
+        if (wrq && (strcasecmp(opt, "tsize") == 0))
+        {
+            // larger than any file we can store, fails the space check
+            accepted = (n > 0xFFFFFFFF) ? 0xFFFFFFFF : n;
+            option = OPT_TSIZE;
+        }
+
+        if ((option != 0) && !(seen & option))
+        {
+            char    entry[32];
+            int     entryLen = snprintf(entry, sizeof(entry), "%s%c%lu", opt, '\0', accepted) + 1;
+
+            // the OACK is built in the session's block window
+            if (oackLen + entryLen <= oackMax)
+            {
+                memcpy(&oack[oackLen], entry, entryLen);
+                oackLen += entryLen;
+                seen |= option;
+
+                if (option == OPT_BLKSIZE)
+                    s->blkSize = accepted;
+                else if (option == OPT_WINDOWSIZE)
+                    s->windowSize = accepted;
+                else
+                    s->tsize = accepted;
+            }
+        }
+
+        opt = val + strlen(val) + 1;
+    }
+
+    if (oackLen > 2)
+    {
+        oack[0] = 0x00;
+        oack[1] = 0x06;
+        s->oackSize = oackLen;
+        s->oackPending = true;
+    }
+
+    return true;
+}
+
+/**
+ * @brief   Finds session of the remote host the last packet came from.
  * @note
  * @param
- * @retval
+ * @retval  Session or NULL.
  */
-void TFTPServer::getBlock()
+TFTPServerBase::Session* TFTPServerBase::findSession()
 {
-    blockCounter++;
+    for (int i = 0; i < maxSessions; i++) {
+        if ((sessions[i].state != LISTENING) && cmpHost(&sessions[i]))
+            return &sessions[i];
+    }
 
-    blockBuff[0] = 0x00;
-    blockBuff[1] = 0x03;
-    blockBuff[2] = blockCounter >> 8;
-    blockBuff[3] = blockCounter & 255;
-    blockSize = 4 + fread((void*) &blockBuff[4], 1, 512, file);
+    return NULL;
 }
 
 /**
- * @brief   Sends DATA block to remote client.
- * @note
+ * @brief   Finds an unused session slot.
+ * @note    Slots with storage requests outstanding are still busy.
  * @param
- * @retval
+ * @retval  Session or NULL if all slots are busy.
  */
-void TFTPServer::sendBlock()
+TFTPServerBase::Session* TFTPServerBase::allocSession()
 {
-    socket->sendto(socketAddr, blockBuff, blockSize);
+    for (int i = 0; i < maxSessions; i++) {
+        if ((sessions[i].state == LISTENING) && (sessions[i].ioPending == 0))
+            return &sessions[i];
+    }
+
+    return NULL;
 }
 
 /**
- * @brief   Compares host's IP and Port with connected remote machine.
- * @note
+ * @brief   Aborts sessions of clients gone silent.
+ * @note    A partial upload is removed and FAILED is reported.
  * @param
- * @retval
+ * @retval  Milliseconds until the next session expires, -1 if none is active.
  */
-int TFTPServer::cmpHost()
+int TFTPServerBase::checkTimeouts()
 {
-    // char    ip[17];
-    // strcpy(ip, socketAddr.get_ip_address());
+    uint32_t    now = ioTime();
+    int         next = -1;
+
+    for (int i = 0; i < maxSessions; i++) {
+        Session*    s = &sessions[i];
+
+        if (s->state == LISTENING)
+            continue;
+
+        uint32_t    idle = now - s->lastActivity;
+
+        if (idle >= TFTP_SESSION_TIMEOUT_MS)
+        {
+            DEBUG_TFTP("Session with %s timed out\r\n", s->remoteAddr.get_ip_address());
+            abortSession(s, "Timeout", ERR_UNDEFINED);
+        }
+        else if ((next < 0) || (TFTP_SESSION_TIMEOUT_MS - idle < (uint32_t)next))
+        {
+            next = TFTP_SESSION_TIMEOUT_MS - idle;
+        }
+    }
 
-    // int port = socketAddr.get_port();
-    // return((strcmp(ip, remoteIP) == 0) && (port == remotePort));
-    return (remoteAddr == socketAddr);
+    return next;
 }
 
 /**
- * @brief   Sends ACK to remote client.
+ * @brief   Closes the file and releases the session slot.
  * @note
- * @param
+ * @param   s  Session to close.
  * @retval
  */
-void TFTPServer::ack(int val)
+void TFTPServerBase::closeSession(Session* s)
 {
-    char    ack[4];
-    ack[0] = 0x00;
-    ack[1] = 0x04;
-    if ((val > 603135) || (val < 0))
-        val = 0;
-    ack[2] = val >> 8;
-    ack[3] = val & 255;
-    socket->sendto(socketAddr, ack, 4);
+    FILE*   file = s->file;
+
+    releaseShared(s);
+    if (s->target != NULL)
+    {
+        s->target->session = NULL;
+        s->target = NULL;
+    }
+
+    s->file = NULL;
+    s->state = LISTENING;
+    s->remoteAddr.set_ip_address("");
+
+    if (file)
+        closeFile(file, s, NULL);
 }
 
 /**
- * @brief   Sends ERROR message to remote client.
- * @note    msg A C-style string with error message to be sent.
- * @param
+ * @brief   Sends ERROR to remote client and closes the session.
+ * @note    A partially received file is removed, a partially written
+ *          block device region is left as it is.
+ * @param   s     Session to abort.
+ * @param   msg   Error message, NULL to send none (client aborted, server reset).
+ * @param   code  TFTP error code.
  * @retval
  */
-void TFTPServer::sendError(const char* msg)
+void TFTPServerBase::abortSession(Session* s, const char* msg, int code)
 {
-    errorBuff[0] = 0x00;
-    errorBuff[1] = 0x05;
-    errorBuff[2] = 0x00;
-    errorBuff[3] = 0x00;
-    errorBuff[4] = '\0';    // termination char
-    strcat(&errorBuff[4], msg);
+    State   st = s->state;
+    bool    stream = (s->target != NULL);
+    bool    opening = (s->file == NULL) && !s->closing && (s->ioPending > 0);
+
+    if (msg != NULL)
+    {
+        notify(s, Event::FAILED, code, msg);
+        sendError(s->remoteAddr, msg, code);
+    }
+    closeSession(s);
+    if ((st == WRITING) && !stream && opening)
+    {
+        // the file can't be removed while the pending OPEN will still open it
+        s->removeAfterOpen = true;
+    }
+    else if ((st == WRITING) && !stream)
+    {
+        IORequest*  req = allocIO(IORequest::REMOVE, s, NULL);
+        req->name = s->fileName;
+        submitIO(req);
+    }
+}
+
+/**
+ * @brief   Returns the bytes transferred so far.
+ * @note    Counts acknowledged blocks when reading, written blocks when writing.
+ * @param   s  Session.
+ * @retval  Bytes.
+ */
+uint32_t TFTPServerBase::transferred(Session* s)
+{
+    uint32_t    n = (s->state == WRITING) ? s->blockWritten : s->blockAcked;
+
+    if ((n == 0) || !s->eof || (n != s->blockSent))
+        return n * s->blkSize;
+
+    return (n - 1) * s->blkSize + (s->lastSize - 4);
+}
+
+/**
+ * @brief   Reports a transfer event.
+ * @note    Must be called before the session is closed.
+ * @param   s       Session.
+ * @param   type    Event type.
+ * @param   error   TFTP error code of FAILED events.
+ * @param   reason  Error message of FAILED events, or NULL.
+ * @retval
+ */
+void TFTPServerBase::notify(Session* s, Event::Type type, int error, const char* reason)
+{
+    if (!eventHandler)
+        return;
+
+    Event   event;
+
+    event.type = type;
+    event.direction = s->state;
+    event.remoteAddr = s->remoteAddr;
+    event.bytes = transferred(s);
+    event.durationMs = ioTime() - s->startTime;
+    event.error = error;
+    snprintf(event.reason, sizeof(event.reason), "%s", reason ? reason : "");
+    event.reason[strcspn(event.reason, "\r\n")] = '\0';
+    strcpy(event.fileName, s->fileName);
+
+    if (eventQueue == NULL)
+        eventHandler(event);
+    else if (eventQueue->call(eventHandler, event) == 0)
+    {
+        DEBUG_TFTP("Event queue full, event dropped.\r\n");
+    }
+}
+
+/**
+ * @brief   Reports a PROGRESS event if another progressBlocks blocks are done.
+ * @note    Called once the session counts up to block to.
+ * @param   s     Session.
+ * @param   from  Blocks done before.
+ * @param   to    Blocks done now.
+ * @retval
+ */
+void TFTPServerBase::notifyProgress(Session* s, uint32_t from, uint32_t to)
+{
+    if ((progressBlocks != 0) && (from / progressBlocks != to / progressBlocks))
+        notify(s, Event::PROGRESS);
+}
+
+/**
+ * @brief   Starts sending once the file is open.
+ * @note
+ * @param   s  Session.
+ * @retval
+ */
+void TFTPServerBase::startRead(Session* s)
+{
+    s->started = true;
+    notify(s, Event::STARTED);
+    if (s->oackPending)
+        socket.sendto(s->remoteAddr, s->blockBuff, s->oackSize);
+    else
+        fillWindow(s);
+}
+
+/**
+ * @brief   Queues the next buffered DATA block of a writing session.
+ * @note    Blocks are written one at a time, in order.
+ * @param   s  Session.
+ * @retval
+ */
+void TFTPServerBase::writeNext(Session* s)
+{
+    if (s->target != NULL)
+    {
+        streamNext(s);
+        return;
+    }
+
+    if ((s->ioPending > 0) || (s->blockWritten == s->blockSent))
+        return;
+
+    uint32_t    n = s->blockWritten + 1;
+    IORequest*  req = allocIO(IORequest::WRITE, s, NULL);
+
+    req->file = s->file;
+    req->buff = blockSlot(s, n) + 4;
+    req->size = blockLen(s, n) - 4;
+    req->block = n;
+    submitIO(req);
+}
+
+/**
+ * @brief   Queues the next program and erase of a session writing a block device.
+ * @note    Blocks are programmed one at a time, in order, once their sectors
+ *          are erased. Meanwhile the next window and at least one whole
+ *          sector beyond the one being programmed are erased, queued behind
+ *          the program, so a block starting a new sector never waits for its
+ *          erase. The final block is padded to the program size.
+ * @param   s  Session.
+ * @retval
+ */
+void TFTPServerBase::streamNext(Session* s)
+{
+    BlockTarget*    t = s->target;
+    bd_size_t       prog = t->bd->get_program_size();
+
+    if (!s->programming && (s->blockWritten < s->blockSent))
+    {
+        uint32_t    n = s->blockWritten + 1;
+        bd_addr_t   at = (bd_addr_t)(n - 1) * s->blkSize;
+        size_t      len = blockLen(s, n) - 4;
+        size_t      padded = (len + prog - 1) / prog * prog;
+
+        if (at + padded > t->size)
+        {
+            abortSession(s, "File too large", ERR_DISK_FULL);
+            return;
+        }
+
+        if (at + padded <= s->erased)
+        {
+            IORequest*  req = allocIO(IORequest::PROGRAM, s, NULL);
+            int         erasedValue = t->bd->get_erase_value();
+
+            memset(blockSlot(s, n) + 4 + len, erasedValue < 0 ? 0xFF : erasedValue, padded - len);
+            s->programming = true;
+            req->bd = t->bd;
+            req->addr = t->addr + at;
+            req->buff = blockSlot(s, n) + 4;
+            req->size = padded;
+            req->block = n;
+            submitIO(req);
+        }
+    }
+
+    if (s->state != WRITING)
+        return;     // closed by an inline completion
+
+    // erase no further than the end of the file, or the announced size
+    bd_size_t   received = (bd_size_t)s->blockSent * s->blkSize;
+    bd_size_t   written = (bd_size_t)s->blockWritten * s->blkSize;
+    bd_size_t   limit = t->size;
+
+    if (s->eof)
+        limit = received - s->blkSize + (s->lastSize - 4);
+    else if (s->tsize > 0)
+        limit = (received > s->tsize) ? received : s->tsize;
+    if (limit > t->size)
+        limit = t->size;
+
+    // keep the next window and one whole sector beyond the one being programmed erased
+    bool        behind = (s->erased < received + (bd_size_t)s->windowSize * s->blkSize)
+                      || (s->erased == 0)
+                      || (s->erased - t->bd->get_erase_size(t->addr + s->erased - 1) <= written);
+
+    if (!s->erasing && (s->erased < limit) && behind)
+    {
+        IORequest*  req = allocIO(IORequest::ERASE, s, NULL);
+
+        s->erasing = true;
+        req->bd = t->bd;
+        req->addr = t->addr + s->erased;
+        req->size = t->bd->get_erase_size(req->addr);
+        submitIO(req);
+    }
+}
+
+/**
+ * @brief   Returns the block device registered for a file name.
+ * @note
+ * @param   name  File name.
+ * @retval  Block device region, or NULL.
+ */
+TFTPServerBase::BlockTarget* TFTPServerBase::findTarget(const char* name)
+{
+    for (int i = 0; i < targetCount; i++) {
+        if (strcmp(targets[i].name, name) == 0)
+            return &targets[i];
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief   Sends a due ACK once all received blocks are written.
+ * @note    The final ACK waits for the file to be closed, or the device synced.
+ * @param   s  Session.
+ * @retval
+ */
+void TFTPServerBase::checkAck(Session* s)
+{
+    if ((s->state != WRITING) || !s->ackDue || (s->blockWritten != s->blockSent))
+        return;
+
+    if (s->eof)
+    {
+        if (!s->closing && (s->ioPending == 0))
+        {
+            IORequest*  req = allocIO(IORequest::CLOSE, s, NULL);
+
+            s->closing = true;
+            req->file = s->file;
+            req->bd = (s->target != NULL) ? s->target->bd : NULL;
+            req->size = s->tsize;
+            req->offset = (long)(s->blockSent - 1) * s->blkSize + (s->lastSize - 4);
+            s->file = NULL;
+            submitIO(req);
+        }
+        return;
+    }
+
+    s->ackDue = false;
+    ack(s, s->blockSent);
+}
+
+/**
+ * @brief   Gets a request from the pool.
+ * @note    Every request has an owner whose slot stays busy until it completes,
+ *          so a session never has more than three (data, close, remove, or
+ *          program and erase of a block device) and
+ *          a shared window never more than two (data, close) outstanding.
+ * @param   op  Operation.
+ * @param   s   Session owning the request, or NULL.
+ * @param   w   Shared window owning the request, or NULL.
+ * @retval
+ */
+TFTPServerBase::IORequest* TFTPServerBase::allocIO(IORequest::Op op, Session* s, SharedWindow* w)
+{
+    IORequest*  req = NULL;
+
+    for (int i = 0; i < ioPoolSize; i++) {
+        if (!ioPool[i].inUse)
+        {
+            req = &ioPool[i];
+            break;
+        }
+    }
+
+    MBED_ASSERT(req != NULL);
+
+    memset(req, 0, sizeof(IORequest));
+    req->op = op;
+    req->inUse = true;
+    req->session = s;
+    req->window = w;
+
+    if (s != NULL)
+        s->ioPending++;
+    if (w != NULL)
+        w->ioPending++;
+
+    return req;
+}
+
+/**
+ * @brief   Queues a request, executing it inline if there is no I/O thread.
+ * @note    The completion may be handled before this returns.
+ * @param   req  Request from allocIO().
+ * @retval
+ */
+void TFTPServerBase::submitIO(IORequest* req)
+{
+    req->submitted = ioTime();
+    ioStats.pending++;
+
+    if (storage != NULL)
+    {
+        storage->submit(req);
+        return;
+    }
+
+    ioStats.inlineRequests++;
+    executeIO(req);
+    completeIO(req);
+}
+
+/**
+ * @brief   Queues closing of a file that is no longer used.
+ * @note    The owner's slot is reused only after the file is closed.
+ * @param   file  File to close.
+ * @param   s     Session owning the file, or NULL.
+ * @param   w     Shared window owning the file, or NULL.
+ * @retval
+ */
+void TFTPServerBase::closeFile(FILE* file, Session* s, SharedWindow* w)
+{
+    IORequest*  req = allocIO(IORequest::CLOSE, s, w);
+
+    req->file = file;
+    submitIO(req);
+}
+
+/**
+ * @brief   Executes a storage request.
+ * @note    Runs in the I/O thread, touches nothing but the request.
+ * @param   req  Request.
+ * @retval
+ */
+void TFTPServerBase::executeIO(IORequest* req)
+{
+    switch (req->op) {
+        case IORequest::OPEN:
+            if (req->size > 0)
+            {
+                // reject uploads that can't fit before taking any data
+                struct statvfs  st;
+                char            dir[TFTP_MAX_FILENAME];
+                char*           slash;
+
+                strcpy(dir, req->name);
+                slash = strrchr(dir, '/');
+                if (slash == NULL)
+                    strcpy(dir, ".");
+                else
+                    slash[slash == dir ? 1 : 0] = '\0';
+
+                if ((statvfs(dir, &st) == 0) && (st.f_frsize > 0))
+                {
+                    uint64_t    needed = (req->size + st.f_frsize - 1) / st.f_frsize;
+                    uint64_t    avail = st.f_bavail;
+                    struct stat old;
+
+                    // Counted in f_frsize units, which FAT reports as its sector size, so
+                    // the upload may still need up to one cluster more than estimated.
+                    // An existing file of the same name is replaced and its space reused.
+                    if (stat(req->name, &old) == 0)
+                        avail += ((uint64_t)old.st_size + st.f_frsize - 1) / st.f_frsize;
+
+                    if (needed > avail)
+                    {
+                        req->result = -ENOSPC;
+                        break;
+                    }
+                }
+            }
+
+            req->file = fopen(req->name, req->mode);
+            if (req->file == NULL)
+            {
+                req->result = -errno;
+                break;
+            }
+            // blocks are read and written whole so stdio buffering is not needed
+            setvbuf(req->file, NULL, _IONBF, 0);
+            if (req->offset)
+                fseek(req->file, req->offset, SEEK_SET);
+#if TFTP_PREALLOCATE
+            // allocate the whole file at once instead of growing block by block
+            if ((req->size > 0) && (ftruncate(fileno(req->file), req->size) != 0))
+            {
+                fclose(req->file);
+                req->file = NULL;
+                remove(req->name);
+                req->result = -ENOSPC;
+                break;
+            }
+#endif
+            req->result = 0;
+            break;
+
+        case IORequest::READ:
+            req->result = fread(req->buff, 1, req->size, req->file);
+            // a short read is the end of the file unless the stream failed
+            if ((req->result < (int)req->size) && ferror(req->file))
+                req->result = -EIO;
+            break;
+
+        case IORequest::WRITE:
+            req->result = fwrite(req->buff, 1, req->size, req->file);
+            break;
+
+        case IORequest::CLOSE:
+            if (req->bd != NULL)
+            {
+                req->result = req->bd->sync();
+                break;
+            }
+#if TFTP_PREALLOCATE
+            // client sent less than announced, drop the reserved tail
+            if ((req->size > 0) && ((size_t)req->offset != req->size))
+                ftruncate(fileno(req->file), req->offset);
+#endif
+            req->result = fclose(req->file);
+            break;
+
+        case IORequest::REMOVE:
+            req->result = remove(req->name);
+            break;
+
+        case IORequest::ERASE:
+            req->result = req->bd->erase(req->addr, req->size);
+            break;
+
+        case IORequest::PROGRAM:
+            req->result = (req->size > 0) ? req->bd->program(req->buff, req->addr, req->size) : 0;
+            break;
+    }
+
+    req->finished = ioTime();
+}
+
+/**
+ * @brief   Handles a finished storage request.
+ * @note    Owners that have been closed meanwhile just drop the result.
+ * @param   done  Request.
+ * @retval
+ */
+void TFTPServerBase::completeIO(IORequest* done)
+{
+    IORequest       result = *done;     // the pool entry may be reused below
+    IORequest*      req = &result;
+    Session*        s = req->session;
+    SharedWindow*   w = req->window;
+    uint32_t        wait = req->finished - req->submitted;
+
+    done->inUse = false;
+
+    ioStats.pending--;
+    ioStats.requests++;
+    ioStats.waitMs += wait;
+    if (wait > ioStats.maxWaitMs)
+        ioStats.maxWaitMs = wait;
+
+    if (w != NULL)
+    {
+        w->ioPending--;
+        switch (req->op) {
+            case IORequest::OPEN:
+                if (w->refs == 0)
+                {
+                    if (req->file)
+                        closeFile(req->file, NULL, w);
+                    break;
+                }
+
+                w->file = req->file;
+                for (int i = 0; i < maxSessions; i++) {
+                    Session*    t = &sessions[i];
+                    if (t->shared != w)
+                        continue;
+                    if (w->file == NULL)
+                        detachShared(t);    // reports the error on its own open
+                    else
+                        startRead(t);
+                }
+                break;
+
+            case IORequest::READ:
+                if (w->refs == 0)
+                    break;
+
+                if (req->result < 0)
+                {
+                    // fail all readers, the window is released with the last one
+                    for (int i = 0; i < maxSessions; i++) {
+                        if (sessions[i].shared == w)
+                            abortSession(&sessions[i], "Read failed", ERR_UNDEFINED);
+                    }
+                    break;
+                }
+
+                w->count++;
+                if (req->result < (int)w->blkSize)
+                {
+                    w->eof = true;
+                    w->lastBlock = req->block;
+                    w->lastSize = 4 + req->result;
+                }
+
+                // wake up all readers waiting for this block
+                for (int i = 0; i < maxSessions; i++) {
+                    if (sessions[i].shared == w)
+                        fillWindow(&sessions[i]);
+                }
+                break;
+
+            default:
+                break;
+        }
+        return;
+    }
+
+    if (s == NULL)
+        return;
+
+    s->ioPending--;
+
+    if (s->state == LISTENING)
+    {
+        // session closed meanwhile
+        if ((req->op == IORequest::OPEN) && req->file)
+            closeFile(req->file, s, NULL);
+        if ((req->op == IORequest::OPEN) && s->removeAfterOpen)
+        {
+            IORequest*  rm = allocIO(IORequest::REMOVE, s, NULL);
+
+            s->removeAfterOpen = false;
+            rm->name = s->fileName;
+            submitIO(rm);
+        }
+        return;
+    }
+
+    switch (req->op) {
+        case IORequest::OPEN:
+            s->file = req->file;
+            if (s->file == NULL)
+            {
+                if (req->result == -ENOSPC)
+                {
+                    snprintf(errorBuff, sizeof(errorBuff), "File too large: %lu bytes\r\n", (unsigned long)s->tsize);
+                    notify(s, Event::FAILED, ERR_DISK_FULL, errorBuff);
+                    sendError(s->remoteAddr, errorBuff, ERR_DISK_FULL);
+                }
+                else if (s->state == WRITING)
+                {
+                    printf("Could not open file to write, error: %d\n", -req->result);
+                    notify(s, Event::FAILED, ERR_ACCESS, "Could not open file to write.");
+                    sendError(s->remoteAddr, "Could not open file to write.\n", ERR_ACCESS);
+                }
+                else
+                {
+                    snprintf(errorBuff, sizeof(errorBuff), "Could not read file: %s\r\n", s->fileName);
+                    notify(s, Event::FAILED, ERR_NOT_FOUND, errorBuff);
+                    sendError(s->remoteAddr, errorBuff, ERR_NOT_FOUND);
+                }
+                closeSession(s);
+            }
+            else if (s->state == WRITING)
+            {
+                // file ready for writing
+                notify(s, Event::STARTED);
+                if (s->oackPending)
+                    socket.sendto(s->remoteAddr, s->blockBuff, s->oackSize);
+                else
+                    ack(s, 0);
+            }
+            else if (!s->started)
+            {
+                // file ready for reading
+                startRead(s);
+            }
+            else
+            {
+                // continue on own file after falling behind the shared window
+                fillWindow(s);
+            }
+            break;
+
+        case IORequest::READ:
+            {
+                uint32_t    n = req->block;
+
+                if (req->result < 0)
+                {
+                    abortSession(s, "Read failed", ERR_UNDEFINED);
+                    break;
+                }
+
+                s->blockSent = n;
+                if (req->result < (int)s->blkSize)
+                {
+                    s->eof = true;
+                    s->lastSize = 4 + req->result;
+                }
+                sendBlock(s, n);
+                fillWindow(s);
+                break;
+            }
+
+        case IORequest::WRITE:
+            if (req->result != (int)req->size)
+            {
+                abortSession(s, "Write failed", ERR_DISK_FULL);
+                break;
+            }
+
+            s->blockWritten = req->block;
+            notifyProgress(s, req->block - 1, req->block);
+            writeNext(s);
+            checkAck(s);
+            break;
+
+        case IORequest::ERASE:
+            s->erasing = false;
+            if (req->result != 0)
+            {
+                abortSession(s, "Erase failed", ERR_ACCESS);
+                break;
+            }
+
+            s->erased += req->size;
+            streamNext(s);
+            checkAck(s);
+            break;
+
+        case IORequest::PROGRAM:
+            s->programming = false;
+            if (req->result != 0)
+            {
+                abortSession(s, "Write failed", ERR_ACCESS);
+                break;
+            }
+
+            s->blockWritten = req->block;
+            notifyProgress(s, req->block - 1, req->block);
+            streamNext(s);
+            checkAck(s);
+            break;
+
+        case IORequest::CLOSE:
+            // final close of a received file
+            if (!s->closing)
+                break;
+
+            if (req->result != 0)
+            {
+                abortSession(s, "Write failed", ERR_DISK_FULL);
+                break;
+            }
+
+            ack(s, s->blockSent);
+            fileCounter++;
+            notify(s, Event::COMPLETED);
+            closeSession(s);
+            DEBUG_TFTP("File receive finished.\r\n");
+            break;
+
+        default:
+            break;
+    }
+}
+
+/**
+ * @brief   Handles all finished storage requests.
+ * @note
+ * @param
+ * @retval
+ */
+void TFTPServerBase::processCompletions()
+{
+    if (storage == NULL)
+        return;
+
+    IORequest*  req;
+    while ((req = storage->getCompleted()) != NULL)
+        completeIO(req);
+}
+
+/**
+ * @brief   Releases the session from its shared window.
+ * @note    The last session leaving closes the shared file.
+ * @param   s  Session.
+ * @retval
+ */
+void TFTPServerBase::releaseShared(Session* s)
+{
+    SharedWindow*   w = s->shared;
+
+    if (w == NULL)
+        return;
+
+    s->shared = NULL;
+    if ((--w->refs == 0) && (w->file != NULL))
+    {
+        closeFile(w->file, NULL, w);
+        w->file = NULL;
+    }
+}
+
+/**
+ * @brief   Attaches a new reading session to a shared window of its file.
+ * @note    Joins a window still holding block 1, otherwise starts a new one.
+ *          The session stays unshared if no window fits.
+ * @param   s  Session.
+ * @retval
+ */
+void TFTPServerBase::attachShared(Session* s)
+{
+    SharedWindow*   w = NULL;
+
+    if ((uint32_t)(sharedPoolSize / (4 + s->blkSize)) < s->windowSize)
+        return;
+
+    for (int i = 0; i < maxWindows; i++) {
+        SharedWindow*   t = &windows[i];
+        if ((t->refs > 0) && (t->first == 1) && (t->blkSize == s->blkSize)
+         && (strcmp(t->fileName, s->fileName) == 0))
+        {
+            w = t;
+            break;
+        }
+
+        if ((t->refs == 0) && (t->ioPending == 0) && (w == NULL))
+            w = t;
+    }
+
+    if (w == NULL)
+        return;
+
+    w->refs++;
+    s->shared = w;
+
+    if (w->refs == 1)
+    {
+        strcpy(w->fileName, s->fileName);
+        w->file = NULL;
+        w->blkSize = s->blkSize;
+        w->capacity = sharedPoolSize / (4 + s->blkSize);
+        w->first = 1;
+        w->count = 0;
+        w->eof = false;
+
+        IORequest*  req = allocIO(IORequest::OPEN, NULL, w);
+        req->name = w->fileName;
+        req->mode = "rb";
+        submitIO(req);
+    }
+
+    DEBUG_TFTP("Sharing %s with %d readers\r\n", w->fileName, w->refs);
+}
+
+/**
+ * @brief   Moves a session from its shared window to its own file and buffers.
+ * @note    Blocks in flight are copied to the session window so they can
+ *          still be retransmitted. The session continues once its file is open.
+ * @param   s  Session.
+ * @retval
+ */
+void TFTPServerBase::detachShared(Session* s)
+{
+    SharedWindow*   w = s->shared;
+
+    s->shared = NULL;
+    for (uint32_t n = s->blockAcked + 1; n <= s->blockSent; n++)
+        memcpy(blockSlot(s, n), sharedSlot(w, n), blockLen(s, n));
+    s->shared = w;
+    releaseShared(s);
+
+    DEBUG_TFTP("Reader of %s fell behind at block %lu\r\n", s->fileName, (unsigned long)s->blockAcked);
+
+    IORequest*  req = allocIO(IORequest::OPEN, s, NULL);
+    req->name = s->fileName;
+    req->mode = "rb";
+    req->offset = (long)s->blockSent * s->blkSize;
+    submitIO(req);
+}
+
+/**
+ * @brief   Makes block n available in the shared window.
+ * @note    When the window is full the oldest block is dropped, sessions
+ *          that have not acknowledged it yet are detached.
+ * @param   s  Session.
+ * @param   n  Block number, at most one past the newest block held.
+ * @retval  true if block n is held, false if s must wait or has been detached.
+ */
+bool TFTPServerBase::fetchShared(Session* s, uint32_t n)
+{
+    SharedWindow*   w = s->shared;
+
+    if (n < w->first + w->count)
+        return true;
+
+    if (w->eof || (w->file == NULL) || (w->ioPending > 0))
+        return false;
+
+    if (w->count == w->capacity)
+    {
+        for (int i = 0; i < maxSessions; i++) {
+            if ((sessions[i].shared == w) && (sessions[i].blockAcked < w->first))
+                detachShared(&sessions[i]);
+        }
+
+        if (s->shared == NULL)
+            return false;
+
+        w->first++;
+        w->count--;
+    }
+
+    uint32_t    m = w->first + w->count;
+    char*       blockBuff = sharedSlot(w, m);
+
+    blockBuff[0] = 0x00;
+    blockBuff[1] = 0x03;
+    blockBuff[2] = (m >> 8) & 255;
+    blockBuff[3] = m & 255;
+
+    IORequest*  req = allocIO(IORequest::READ, NULL, w);
+    req->file = w->file;
+    req->buff = &blockBuff[4];
+    req->size = w->blkSize;
+    req->block = m;
+    submitIO(req);
+
+    return (n < w->first + w->count);
+}
+
+/**
+ * @brief   Returns buffer of DATA block n within the shared window.
+ * @note
+ * @param   w  Shared window.
+ * @param   n  Block number.
+ * @retval
+ */
+char* TFTPServerBase::sharedSlot(SharedWindow* w, uint32_t n)
+{
+    return &w->blocks[(n % w->capacity) * (4 + w->blkSize)];
+}
+
+/**
+ * @brief   Returns buffer of DATA block n within the session window.
+ * @note
+ * @param   s  Session.
+ * @param   n  Block number.
+ * @retval
+ */
+char* TFTPServerBase::blockSlot(Session* s, uint32_t n)
+{
+    if (s->shared != NULL)
+        return sharedSlot(s->shared, n);
+
+    return &s->blockBuff[(n % s->windowSize) * (4 + s->blkSize)];
+}
+
+/**
+ * @brief   Returns packet size of DATA block n.
+ * @note    Only the final block may be short.
+ * @param   s  Session.
+ * @param   n  Block number.
+ * @retval
+ */
+int TFTPServerBase::blockLen(Session* s, uint32_t n)
+{
+    if (s->eof && (n == s->blockSent))
+        return s->lastSize;
+
+    return 4 + s->blkSize;
+}
+
+/**
+ * @brief   Gets DATA block from file on disk into memory.
+ * @note    Own reads complete in completeIO(), which sends the block.
+ * @param   s  Session.
+ * @retval  true if a block was sent or requested, false if s must wait.
+ */
+bool TFTPServerBase::getBlock(Session* s)
+{
+    uint32_t    n = s->blockSent + 1;
+
+    if (s->shared != NULL)
+    {
+        SharedWindow*   w = s->shared;
+
+        if (!fetchShared(s, n))
+            return false;
+
+        s->blockSent = n;
+        if (w->eof && (n == w->lastBlock))
+        {
+            s->eof = true;
+            s->lastSize = w->lastSize;
+        }
+        sendBlock(s, n);
+        return true;
+    }
+
+    if (s->file == NULL)
+        return false;   // still opening
+
+    char*       blockBuff = blockSlot(s, n);
+
+    blockBuff[0] = 0x00;
+    blockBuff[1] = 0x03;
+    blockBuff[2] = (n >> 8) & 255;
+    blockBuff[3] = n & 255;
+
+    IORequest*  req = allocIO(IORequest::READ, s, NULL);
+    req->file = s->file;
+    req->buff = &blockBuff[4];
+    req->size = s->blkSize;
+    req->block = n;
+    submitIO(req);
+
+    return true;
+}
+
+/**
+ * @brief   Sends DATA block to remote client.
+ * @note
+ * @param   s  Session.
+ * @param   n  Block number.
+ * @retval
+ */
+void TFTPServerBase::sendBlock(Session* s, uint32_t n)
+{
+    socket.sendto(s->remoteAddr, blockSlot(s, n), blockLen(s, n));
+}
+
+/**
+ * @brief   Reads and sends blocks until the window is full.
+ * @note    Stops early while a read of the session is outstanding,
+ *          its completion continues filling.
+ * @param   s  Session.
+ * @retval
+ */
+void TFTPServerBase::fillWindow(Session* s)
+{
+    if (s->filling)
+        return;
+
+    s->filling = true;
+    while ((s->state == READING) && s->started && !s->eof && (s->ioPending == 0)
+        && (s->blockSent - s->blockAcked < s->windowSize)) {
+        if (!getBlock(s))
+            break;
+    }
+    s->filling = false;
+}
+
+/**
+ * @brief   Compares host's IP and Port with connected remote machine.
+ * @note
+ * @param   s  Session.
+ * @retval
+ */
+int TFTPServerBase::cmpHost(Session* s)
+{
+    return (s->remoteAddr == socketAddr);
+}
+
+/**
+ * @brief   Sends ACK to remote client.
+ * @note
+ * @param   s    Session.
+ * @param   val  Block number to acknowledge.
+ * @retval
+ */
+void TFTPServerBase::ack(Session* s, uint32_t val)
+{
+    char    ack[4];
+    ack[0] = 0x00;
+    ack[1] = 0x04;
+    ack[2] = (val >> 8) & 255;
+    ack[3] = val & 255;
+    socket.sendto(s->remoteAddr, ack, 4);
+    s->blockAcked = val;
+}
+
+/**
+ * @brief   Sends ERROR message to the host the last packet came from.
+ * @note
+ * @param   msg   A C-style string with error message to be sent.
+ * @param   code  TFTP error code.
+ * @retval
+ */
+void TFTPServerBase::sendError(const char* msg, int code)
+{
+    sendError(socketAddr, msg, code);
+}
+
+/**
+ * @brief   Sends ERROR message to remote client.
+ * @note
+ * @param   addr  Remote client.
+ * @param   msg   A C-style string with error message to be sent.
+ * @param   code  TFTP error code.
+ * @retval
+ */
+void TFTPServerBase::sendError(const SocketAddress& addr, const char* msg, int code)
+{
+    char    buff[4 + TFTP_ERROR_BUFF_SIZE];
+
+    buff[0] = 0x00;
+    buff[1] = 0x05;
+    buff[2] = 0x00;
+    buff[3] = code;
 
-    int len = 4 + strlen(&errorBuff[4]) + 1;
-    socket->sendto(socketAddr, errorBuff, len);
+    int len = 4 + snprintf(&buff[4], TFTP_ERROR_BUFF_SIZE, "%s", msg) + 1;
+    if (len > (int)sizeof(buff))
+        len = sizeof(buff);
+    socket.sendto(addr, buff, len);
     DEBUG_TFTP("Error: %s\r\n", msg);
 }
 
@@ -534,7 +2043,7 @@ void TFTPServer::sendError(const char* msg)
  * @param
  * @retval
  */
-int TFTPServer::modeOctet(char* buff)
+int TFTPServerBase::modeOctet(char* buff)
 {
     int x = 2;
 
@@ -22,18 +22,37 @@
  *
  * Minimal TFTP Server
  *      * Receive and send files via TFTP
- *      * Server handles only one transfer at a time
- *      * Supports only octet (raw 8 bit bytes) mode transfers
- *      * fixed block size: 512 bytes
+ *      * Handles up to MaxSessions transfers at a time
+ *      * Transfers of clients gone silent for TFTP_SESSION_TIMEOUT_MS
+ *        are aborted so their slots are freed
+ *      * Supports octet (raw 8 bit bytes) and netascii mode transfers
+ *      * Negotiates blksize (RFC 2348) up to MaxBlockSize
+ *        and windowsize (RFC 7440) up to Window
+ *      * Uploads announcing tsize (RFC 2349) are checked against free space
+ *        before the first DATA block, and preallocated with
+ *        TFTP_PREALLOCATE on FAT
+ *      * Concurrent readers of the same file share one window of blocks
+ *        read from storage once (SharedFiles, SharedBlocks)
+ *      * Uploads of reserved names stream straight into a BlockDevice
+ *        region, erasing ahead of the blocks being programmed
+ *      * Reports transfer start, progress, completion and failure through
+ *        a callback, optionally posted to an application EventQueue
+ *      * Storage access can be offloaded to a ThreadTFTPStorage so a slow
+ *        file system never stalls the other transfers
+ *      * All sockets, session state and packet buffers are allocated
+ *        statically, no heap allocations after construction
  *
  * http://spectral.mscs.mu.edu/RFC/rfc1350.html
  *
  * Example:
  * @code 
- * TFTPServer *server;
- * ...
- * server = new TFTPServer();
+ * // 4 sessions, blocks up to 1428 bytes, up to 4 blocks in flight
+ * static StaticTFTPServer<4, 1428, 4> server;
+ * static_assert(StaticTFTPServer<4, 1428, 4>::footprint() < 16 * 1024, "TFTP RAM");
  * ...
+ * server.open(net);
+ * while (true)
+ *     server.poll();
  * @endcode
  *
  */
@@ -41,13 +60,55 @@
 #define _TFTPSERVER_H_
 
 #include "mbed.h"
+#include "blockdevice/BlockDevice.h"
 
 using namespace mbed;
 
 #define TFTP_PORT   69
 
-class TFTPServer
+#ifndef TFTP_MAX_FILENAME
+#define TFTP_MAX_FILENAME       260     // Filename buffer size per session
+#endif
+
+#ifndef TFTP_ERROR_BUFF_SIZE
+#define TFTP_ERROR_BUFF_SIZE    128     // ERROR packet buffer size
+#endif
+
+#ifndef TFTP_EVENT_REASON_LEN
+#define TFTP_EVENT_REASON_LEN   48      // Failure reason buffer size per event
+#endif
+
+#ifndef TFTP_MAX_BLOCKDEVICES
+#define TFTP_MAX_BLOCKDEVICES   1       // Reserved names streamed into a BlockDevice
+#endif
+
+#define TFTP_DEFAULT_BLKSIZE    512     // RFC 1350 block size
+#define TFTP_MAX_BLKSIZE        65464   // RFC 2348 upper limit
+#define TFTP_MAX_WINDOWSIZE     65535   // RFC 7440 upper limit
+
+// Grow uploads to their tsize when opened. Meant for FAT, where ftruncate()
+// only allocates clusters. Leave it off on LittleFS, which writes the whole
+// tsize as zeros first and so programs every block twice.
+#ifndef TFTP_PREALLOCATE
+#define TFTP_PREALLOCATE        0
+#endif
+
+#ifndef TFTP_IO_POLL_MS
+#define TFTP_IO_POLL_MS         2       // Socket timeout while storage requests are outstanding
+#endif
+
+#ifndef TFTP_SESSION_TIMEOUT_MS
+#define TFTP_SESSION_TIMEOUT_MS 10000   // Transfer aborted after this long without a packet
+#endif
+
+class ThreadTFTPStorage;
+
+class TFTPServerBase
 {
+protected:
+    struct Session;
+    struct SharedWindow;
+
 public:
     enum State
     {
@@ -59,14 +120,101 @@ public:
         DELETED
     };
 
-    // Creates a new TFTP server listening on myPort.
-    TFTPServer(NetworkInterface* net, uint16_t myPort = TFTP_PORT);
-    
-    // Destroys this instance of the TFTP server.
-    ~TFTPServer();
-    
+    // TFTP error codes (RFC 1350, RFC 2347)
+    enum ErrorCode
+    {
+        ERR_UNDEFINED       = 0,
+        ERR_NOT_FOUND       = 1,
+        ERR_ACCESS          = 2,
+        ERR_DISK_FULL       = 3,
+        ERR_ILLEGAL_OP      = 4,
+        ERR_UNKNOWN_TID     = 5,
+        ERR_FILE_EXISTS     = 6,
+        ERR_NO_USER         = 7,
+        ERR_OPTION          = 8
+    };
+
+    // Storage operation, executed inline or by a ThreadTFTPStorage.
+    struct IORequest
+    {
+        enum Op
+        {
+            OPEN,
+            READ,
+            WRITE,
+            CLOSE,
+            REMOVE,
+            ERASE,
+            PROGRAM
+        };
+
+        Op              op;
+        IORequest*      next;                   // ThreadTFTPStorage queue link
+        bool            inUse;                  // Taken from the request pool
+        Session*        session;                // Owning session, or NULL
+        SharedWindow*   window;                 // Owning shared window, or NULL
+        FILE*           file;                   // File to access, OPEN: opened file
+        const char*     name;                   // OPEN, REMOVE: file name
+        const char*     mode;                   // OPEN: fopen mode
+        BlockDevice*    bd;                     // ERASE, PROGRAM, CLOSE: device instead of file
+        bd_addr_t       addr;                   // ERASE, PROGRAM: device address
+        char*           buff;                   // READ, WRITE, PROGRAM: data
+        size_t          size;                   // READ, WRITE, ERASE, PROGRAM: data size
+                                                // OPEN: space to reserve (tsize), 0: none
+                                                // CLOSE: space reserved, 0: none
+        long            offset;                 // OPEN: initial file position
+                                                // CLOSE: final file size if space was reserved
+        uint32_t        block;                  // READ, PROGRAM: block number
+        int             result;                 // Bytes transferred, 0 or -errno
+        uint32_t        submitted;              // Time queued [ms]
+        uint32_t        finished;               // Time done [ms]
+    };
+
+    // Time spent waiting on storage.
+    struct IOStats
+    {
+        uint32_t        requests;               // Completed requests
+        uint32_t        waitMs;                 // Total time from submit to completion
+        uint32_t        maxWaitMs;              // Longest single wait
+        uint32_t        inlineRequests;         // Requests executed in the network thread
+                                                // (no ThreadTFTPStorage attached)
+        int             pending;                // Requests outstanding now
+    };
+
+    // Transfer notification.
+    struct Event
+    {
+        enum Type
+        {
+            STARTED,                            // File opened, first packet sent
+            PROGRESS,                           // Another progressBlocks blocks transferred
+            COMPLETED,                          // File sent or received completely
+            FAILED                              // Transfer aborted
+        };
+
+        Type            type;
+        State           direction;              // READING (download) or WRITING (upload)
+        SocketAddress   remoteAddr;             // Remote client
+        uint32_t        bytes;                  // Bytes transferred (acknowledged or written)
+        uint32_t        durationMs;             // Time since the request
+        int             error;                  // FAILED: TFTP error code
+        char            reason[TFTP_EVENT_REASON_LEN];  // FAILED: error message
+        char            fileName[TFTP_MAX_FILENAME];
+    };
+
+    typedef Callback<void(const Event&)> EventHandler;
+
+    // Executes a storage request.
+    static void     executeIO(IORequest* req);
+
+    // Opens the socket and starts listening on myPort.
+    int             open(NetworkInterface* net, uint16_t myPort = TFTP_PORT);
+
     // Resets the TFTP server.
     void            reset();
+
+    // Aborts all transfers and closes the socket.
+    void            close();
     
     // Gets current TFTP status
     State           getState();
@@ -82,47 +230,340 @@ public:
     
     // Gets the filename during read and write. 
     void            getFileName(char* name);
+
+    // Gets the filename during read and write, truncated to size.
+    void            getFileName(char* name, size_t size);
     
     // Returns number of received files.
     int             fileCount();
-    
+
+    // Returns number of transfers in progress.
+    int             activeSessions();
+
+    // Issues storage requests to an I/O thread, NULL executes them inline.
+    void            setStorage(ThreadTFTPStorage* storage);
+
+    // Gets storage wait statistics.
+    IOStats         getIOStats();
+
+    // Reports transfer events to handler, posted to queue if not NULL.
+    void            attach(EventHandler handler, EventQueue* queue = NULL, uint32_t progressBlocks = 0);
+
+    // Streams uploads of name straight into size bytes of bd starting at addr.
+    int             addBlockDevice(const char* name, BlockDevice* bd, bd_addr_t addr, bd_size_t size);
+
+protected:
+    // Reserved file name backed by a BlockDevice region.
+    struct BlockTarget
+    {
+        const char*     name;                   // Reserved file name
+        BlockDevice*    bd;                     // Initialized device
+        bd_addr_t       addr;                   // Region start, erase aligned
+        bd_size_t       size;                   // Region size, erase aligned
+        Session*        session;                // Upload in progress, or NULL
+    };
+
+    // State of a single transfer.
+    struct Session
+    {
+        State           state;                  // LISTENING (unused), READING or WRITING
+        SocketAddress   remoteAddr;             // Connected remote Host IP and Port
+        FILE*           file;                   // File to read or write, NULL while shared
+        SharedWindow*   shared;                 // READING: shared block window or NULL
+        char*           blockBuff;              // Window of DATA blocks, points into the block pool
+        uint32_t        blockSent;              // READING: last block read and sent
+                                                // WRITING: last block received
+        uint32_t        blockAcked;             // Last block acknowledged
+        uint16_t        dupCounter;             // DUP counter
+        uint16_t        blkSize;                // Negotiated block size
+        uint16_t        windowSize;             // Negotiated window size
+        uint16_t        lastSize;               // Size of the final (short) DATA packet
+        bool            eof;                    // READING: final block has been read
+        bool            oackPending;            // OACK sent, waiting for ACK 0 or DATA 1
+        int             oackSize;               // OACK packet size (kept at blockBuff)
+        uint32_t        blockWritten;           // WRITING: last block written to the file
+        uint32_t        tsize;                  // WRITING: announced file size, 0: unknown
+        uint32_t        startTime;              // Time of the request [ms]
+        uint32_t        lastActivity;           // Time of the last packet from the client [ms]
+        BlockTarget*    target;                 // WRITING: device streamed into, NULL: file
+        bd_size_t       erased;                 // WRITING: bytes of the region erased
+        uint8_t         ioPending;              // Storage requests outstanding, slot busy until 0
+        bool            started;                // READING: file opened and transfer started
+        bool            filling;                // READING: fillWindow() in progress
+        bool            ackDue;                 // WRITING: ACK as soon as all blocks are written
+        bool            closing;                // WRITING: final close requested
+        bool            removeAfterOpen;        // WRITING: aborted while opening, remove once closed
+        bool            erasing;                // WRITING: erase of the target in progress
+        bool            programming;            // WRITING: program of the target in progress
+        char            fileName[TFTP_MAX_FILENAME];
+    };
+
+    // Blocks of a file read once on behalf of all sessions reading it.
+    // Holds blocks first .. first + count - 1, a block is dropped once every
+    // attached session has it acknowledged.
+    struct SharedWindow
+    {
+        int             refs;                   // Attached sessions, 0 if unused
+        FILE*           file;                   // Shared stream, positioned after the newest block
+        char*           blocks;                 // Ring of DATA packets, points into the shared pool
+        uint32_t        capacity;               // Ring size in blocks
+        uint32_t        first;                  // Oldest block held
+        uint32_t        count;                  // Blocks held
+        uint32_t        lastBlock;              // Final block number once eof is set
+        uint16_t        lastSize;               // Size of the final (short) DATA packet
+        uint16_t        blkSize;                // Block size of all attached sessions
+        bool            eof;                    // Final block has been read
+        uint8_t         ioPending;              // Storage requests outstanding, slot busy until 0
+        char            fileName[TFTP_MAX_FILENAME];
+    };
+
+    // Shared read windows of a StaticTFTPServer, empty without shared files.
+    template <int Files, int Bytes>
+    struct SharedStorage
+    {
+        SharedWindow    windows[Files];
+        char            pool[Bytes];
+
+        SharedWindow*   getWindows()    { return windows; }
+        char*           getPool()       { return pool; }
+    };
+
+    template <int Bytes>
+    struct SharedStorage<0, Bytes>
+    {
+        SharedWindow*   getWindows()    { return NULL; }
+        char*           getPool()       { return NULL; }
+    };
+
+    // Storage is owned by the derived class, see StaticTFTPServer.
+    TFTPServerBase(Session* sessions, int maxSessions,
+                   char* blockPool, int maxBlockSize, int maxWindow,
+                   char* rxBuff,
+                   SharedWindow* windows, int maxWindows,
+                   char* sharedPool, int sharedPoolSize,
+                   IORequest* ioPool, int ioPoolSize);
+
+    // Destroys this instance of the TFTP server, the derived class calls close() first.
+    ~TFTPServerBase();
+
 private:
+    // Dispatches a packet received from a connected remote client.
+    void            handleSession(Session* s, char* buff, int len);
+
     // Creates a new connection reading a file from server.
-    void            connectRead(char* buff);
+    void            connectRead(char* buff, int len);
     
     // Creates a new connection writing a file to the server.
-    void            connectWrite(char* buff);
-    
-    // Gets DATA block from file on disk into memory.
-    void            getBlock();
+    void            connectWrite(char* buff, int len);
+
+    // Parses request options and builds OACK. Returns false on malformed request.
+    bool            parseRequest(Session* s, char* buff, int len, bool* octet);
+
+    // Finds session of the remote host the last packet came from.
+    Session*        findSession();
+
+    // Finds an unused session slot.
+    Session*        allocSession();
+
+    // Aborts sessions of clients gone silent. Returns ms until the next expiry, -1: none.
+    int             checkTimeouts();
+
+    // Closes the file and releases the session slot.
+    void            closeSession(Session* s);
+
+    // Sends ERROR to remote client and closes the session.
+    void            abortSession(Session* s, const char* msg, int code = ERR_UNDEFINED);
+
+    // Returns bytes acknowledged (READING) or written (WRITING).
+    uint32_t        transferred(Session* s);
+
+    // Reports a transfer event.
+    void            notify(Session* s, Event::Type type, int error = ERR_UNDEFINED, const char* reason = NULL);
+
+    // Reports a PROGRESS event if another progressBlocks blocks are done.
+    void            notifyProgress(Session* s, uint32_t from, uint32_t to);
+
+    // Opens the file of a reading session, or of its shared window.
+    void            startRead(Session* s);
+
+    // Queues the next buffered DATA block of a writing session.
+    void            writeNext(Session* s);
+
+    // Queues the next program and erase of a session writing a block device.
+    void            streamNext(Session* s);
+
+    // Returns the block device registered for name, or NULL.
+    BlockTarget*    findTarget(const char* name);
+
+    // Sends a due ACK once all received blocks are written.
+    void            checkAck(Session* s);
+
+    // Gets a request from the pool, or NULL.
+    IORequest*      allocIO(IORequest::Op op, Session* s, SharedWindow* w);
+
+    // Queues a request, executing it inline if there is no I/O thread.
+    void            submitIO(IORequest* req);
+
+    // Queues closing of a file that is no longer used.
+    void            closeFile(FILE* file, Session* s, SharedWindow* w);
+
+    // Handles a finished storage request.
+    void            completeIO(IORequest* done);
+
+    // Handles all finished storage requests.
+    void            processCompletions();
+
+    // Releases the session from its shared window.
+    void            releaseShared(Session* s);
+
+    // Attaches a new reading session to a shared window of its file.
+    void            attachShared(Session* s);
+
+    // Moves a session from its shared window to its own file and buffers.
+    void            detachShared(Session* s);
+
+    // Makes block n available in the shared window. Returns false if s must wait.
+    bool            fetchShared(Session* s, uint32_t n);
+
+    // Returns buffer of DATA block n within the shared window.
+    char*           sharedSlot(SharedWindow* w, uint32_t n);
+
+    // Returns buffer of DATA block n within the session window.
+    char*           blockSlot(Session* s, uint32_t n);
+
+    // Returns packet size of DATA block n.
+    int             blockLen(Session* s, uint32_t n);
+
+    // Gets DATA block from file on disk into memory. Returns false if s must wait.
+    bool            getBlock(Session* s);
     
     // Sends DATA block to remote client.
-    void            sendBlock();
+    void            sendBlock(Session* s, uint32_t n);
+
+    // Reads and sends blocks until the window is full.
+    void            fillWindow(Session* s);
     
     // Compares host's IP and Port with connected remote machine.
-    int             cmpHost();
+    int             cmpHost(Session* s);
     
     // Sends ACK to remote client.
-    void            ack(int val);
+    void            ack(Session* s, uint32_t val);
     
+    // Sends ERROR message to the host the last packet came from.
+    void            sendError(const char* msg, int code = ERR_UNDEFINED);
+
     // Sends ERROR message to remote client.
-    void            sendError(const char* msg);
+    void            sendError(const SocketAddress& addr, const char* msg, int code = ERR_UNDEFINED);
     
     // Checks if connection mode of client is octet/binary.
     int             modeOctet(char* buff);
-    
+
+    NetworkInterface*   net;                    // Network the socket is opened on
     uint16_t        port;                       // TFTP port
-    UDPSocket*      socket;                     // Main listening socket (dflt: UDP port 69)
+    UDPSocket       socket;                     // Main listening socket (dflt: UDP port 69)
     State           state;                      // Current TFTP server state
-    SocketAddress   remoteAddr;                 // Connected remote Host IP
-    //int             remotePort;                 // Connected remote Host Port
-    uint16_t        blockCounter, dupCounter;   // Block counter, and DUP counter
-    FILE*           file;                       // Current file to read or write
-    char            blockBuff[516];             // Current DATA block;
-    int             blockSize;                  // Last DATA block size while sending
-    char            fileName[260];              // Current (or most recent) filename
+    Session*        sessions;                   // Session table
+    int             maxSessions;                // Number of session slots
+    char*           blockPool;                  // DATA block windows, one per session
+    int             maxBlockSize;               // Largest block size accepted
+    int             maxWindow;                  // Largest window size accepted
+    char*           rxBuff;                     // Receive buffer (4 + maxBlockSize + 2)
+    SharedWindow*   windows;                    // Shared read windows
+    int             maxWindows;                 // Number of shared read windows
+    char*           sharedPool;                 // Shared window blocks, one region per window
+    int             sharedPoolSize;             // Region size per window
+    IORequest*      ioPool;                     // Storage request pool
+    int             ioPoolSize;                 // Number of storage requests
+    ThreadTFTPStorage*  storage;                // I/O thread or NULL
+    IOStats         ioStats;                    // Storage wait statistics
+    EventHandler    eventHandler;               // Transfer event handler
+    EventQueue*     eventQueue;                 // Queue to post events to, NULL: call directly
+    uint32_t        progressBlocks;             // Blocks between PROGRESS events, 0: none
+    BlockTarget     targets[TFTP_MAX_BLOCKDEVICES];    // Reserved names
+    int             targetCount;                // Reserved names registered
+    Session*        lastSession;                // Session of the most recent request, or NULL
+    Mutex           fileNameMutex;              // Guards lastSession and its fileName against getFileName()
     int             fileCounter;                // Received file counter
-    char            errorBuff[128];             // Error message buffer
+    char            errorBuff[TFTP_ERROR_BUFF_SIZE];    // Error message buffer
     SocketAddress   socketAddr;                 // Socket's addres (used to get remote host's address)
 };
+
+/**
+ * TFTP server with all state allocated in the object itself.
+ *
+ * @tparam MaxSessions   Number of concurrent transfers.
+ * @tparam MaxBlockSize  Largest negotiable block size (>= 512).
+ * @tparam Window        Largest negotiable window size, i.e. DATA blocks
+ *                       buffered per session for retransmission.
+ * @tparam SharedFiles   Number of files readers can share blocks of (0: off).
+ * @tparam SharedBlocks  Blocks of MaxBlockSize held per shared file. A reader
+ *                       falling further behind continues on its own file.
+ */
+template <int MaxSessions, int MaxBlockSize = TFTP_DEFAULT_BLKSIZE, int Window = 1,
+          int SharedFiles = 0, int SharedBlocks = 0>
+class StaticTFTPServer : public TFTPServerBase
+{
+    static_assert(MaxSessions >= 1, "MaxSessions must be at least 1");
+    static_assert(MaxBlockSize >= TFTP_DEFAULT_BLKSIZE && MaxBlockSize <= TFTP_MAX_BLKSIZE,
+                  "MaxBlockSize must be within 512..65464");
+    static_assert(Window >= 1 && Window <= TFTP_MAX_WINDOWSIZE, "Window must be within 1..65535");
+    static_assert(SharedFiles == 0 || SharedBlocks >= Window,
+                  "SharedBlocks must hold at least one window");
+
+    static constexpr int sharedBytes = SharedFiles * SharedBlocks * (4 + MaxBlockSize);
+
+    // data request + close + remove per session, read + close per shared window
+    static constexpr int ioSlots = 3 * MaxSessions + 2 * SharedFiles;
+
+public:
+    // Packet buffer bytes (DATA windows and receive buffer).
+    static constexpr size_t bufferBytes = (size_t)MaxSessions * Window * (4 + MaxBlockSize)
+                                        + (4 + MaxBlockSize + 2)
+                                        + (size_t)sharedBytes;
+
+    // Session state bytes.
+    static constexpr size_t sessionBytes = (size_t)MaxSessions * sizeof(Session)
+                                         + (size_t)SharedFiles * sizeof(SharedWindow)
+                                         + (size_t)ioSlots * sizeof(IORequest);
+
+    // Exact RAM footprint of this server object.
+    static constexpr size_t footprint() { return sizeof(StaticTFTPServer); }
+
+    // Creates a TFTP server, call open() when the network is up.
+    StaticTFTPServer() :
+        TFTPServerBase(_sessions, MaxSessions, _blockPool, MaxBlockSize, Window, _rxBuff,
+                       _shared.getWindows(), SharedFiles, _shared.getPool(), SharedBlocks * (4 + MaxBlockSize),
+                       _ioPool, ioSlots)
+    { }
+
+    // Creates a new TFTP server listening on myPort.
+    StaticTFTPServer(NetworkInterface* net, uint16_t myPort = TFTP_PORT) :
+        TFTPServerBase(_sessions, MaxSessions, _blockPool, MaxBlockSize, Window, _rxBuff,
+                       _shared.getWindows(), SharedFiles, _shared.getPool(), SharedBlocks * (4 + MaxBlockSize),
+                       _ioPool, ioSlots)
+    {
+        open(net, myPort);
+    }
+
+    // Stops the server while the session table still exists.
+    ~StaticTFTPServer()
+    {
+        close();
+    }
+
+private:
+    Session _sessions[MaxSessions];
+    char    _blockPool[MaxSessions * Window * (4 + MaxBlockSize)];
+    char    _rxBuff[4 + MaxBlockSize + 2];
+    SharedStorage<SharedFiles, sharedBytes> _shared;
+    IORequest   _ioPool[ioSlots];
+};
+
+// Classic single transfer server with fixed 512 byte blocks.
+class TFTPServer : public StaticTFTPServer<1>
+{
+public:
+    TFTPServer() { }
+    TFTPServer(NetworkInterface* net, uint16_t myPort = TFTP_PORT) : StaticTFTPServer<1>(net, myPort) { }
+};
 #endif
@@ -22,12 +22,33 @@
 
 #include "threadTFTPServer.h"
 
-#define STACKSIZE   (4 * 1024)
 #define THREADNAME  "TFTPServer"
 
+/*
+    defaultServer() : server of ThreadTFTPServer(pollingInterval), only
+                      linked in if that constructor is used
+*/
+static TFTPServerBase* defaultServer()
+{
+    static TFTPServer server;
+    static bool taken = false;
+
+    MBED_ASSERT(!taken);
+    taken = true;
+    return &server;
+}
+
 ThreadTFTPServer::ThreadTFTPServer(int pollingInterval) :
-    _thread(osPriorityNormal, STACKSIZE, nullptr, THREADNAME),
-    _cycleTime(pollingInterval)
+    ThreadTFTPServer(defaultServer(), nullptr, pollingInterval)
+{
+}
+
+ThreadTFTPServer::ThreadTFTPServer(TFTPServerBase* server, ThreadTFTPStorage* storage, int pollingInterval) :
+    _tftpServer(server),
+    _storage(storage),
+    _thread(osPriorityNormal, TFTP_SERVER_STACKSIZE, _stack, THREADNAME),
+    _cycleTime(pollingInterval),
+    _running(false)
 {
 }
 
@@ -42,10 +63,47 @@ void ThreadTFTPServer::start(NetworkInterface* net, uint16_t myPort)
     _network = net;
     _port = myPort;
 
+    if(_storage) {
+        _storage->start();
+        _tftpServer->setStorage(_storage);
+    }
+
     _running = true;
     _thread.start( callback(this, &ThreadTFTPServer::myThreadFn) );
 }
 
+/*
+    getIOStats() : time the server spent waiting on storage
+*/
+TFTPServerBase::IOStats ThreadTFTPServer::getIOStats()
+{
+    return _tftpServer->getIOStats();
+}
+
+/*
+    attach() : reports transfer events
+*/
+void ThreadTFTPServer::attach(TFTPServerBase::EventHandler handler, EventQueue* queue, uint32_t progressBlocks)
+{
+    _tftpServer->attach(handler, queue, progressBlocks);
+}
+
+/*
+    addBlockDevice() : streams uploads of name into a block device region
+*/
+int ThreadTFTPServer::addBlockDevice(const char* name, BlockDevice* bd, bd_addr_t addr, bd_size_t size)
+{
+    return _tftpServer->addBlockDevice(name, bd, addr, size);
+}
+
+/*
+    getFileName() : name of the most recent transfer
+*/
+void ThreadTFTPServer::getFileName(char* name, size_t size)
+{
+    _tftpServer->getFileName(name, size);
+}
+
 
 /*
     start() : starts the thread
@@ -57,8 +115,7 @@ void ThreadTFTPServer::myThreadFn()
     // DigitalOut led1(LED1);
 
     printf("TFTPServer starting...\n");
-    _tftpServer = new TFTPServer(_network, _port);
-    if(_tftpServer == nullptr){
+    if(_tftpServer->open(_network, _port) != 0){
         printf("Error: creating TFTPServer failed\n");
         return;
     }
@@ -22,28 +22,69 @@
 
 #include "mbed.h"
 #include "TFTPServer.h"
+#include "threadTFTPStorage.h"
 
 #ifndef __threadFnTFTPServer_h__
 #define __threadFnTFTPServer_h__
 
+#ifndef TFTP_SERVER_STACKSIZE
+#define TFTP_SERVER_STACKSIZE   (4 * 1024)
+#endif
+
 class ThreadTFTPServer
 {
     public:
+    /*
+        runs a built-in single transfer TFTPServer, statically allocated and
+        shared, so only one ThreadTFTPServer may be created this way
+    */
     ThreadTFTPServer(int pollingInterval = 50);
 
     /*
-        start() : starts the thread
+        server  : statically allocated server to run, e.g. TFTPServer for a
+                  single transfer or StaticTFTPServer<4, 1428, 4>
+        storage : I/O thread for file access, nullptr to access files from
+                  the server thread (no second thread and stack)
+    */
+    ThreadTFTPServer(TFTPServerBase* server, ThreadTFTPStorage* storage = nullptr, int pollingInterval = 50);
+
+    /*
+        start() : starts the thread, and the storage thread if there is one
     */
     void start(NetworkInterface* network, uint16_t myPort = TFTP_PORT);
 
+    /*
+        getIOStats() : time the server spent waiting on storage
+    */
+    TFTPServerBase::IOStats getIOStats();
+
+    /*
+        attach() : reports transfer events, posted to queue so that the
+                   handler runs in the application thread
+    */
+    void attach(TFTPServerBase::EventHandler handler, EventQueue* queue = NULL, uint32_t progressBlocks = 0);
+
+    /*
+        addBlockDevice() : uploads of name go straight into a region of bd,
+                           call before start()
+    */
+    int addBlockDevice(const char* name, BlockDevice* bd, bd_addr_t addr, bd_size_t size);
+
+    /*
+        getFileName() : name of the most recent transfer, truncated to size
+    */
+    void getFileName(char* name, size_t size);
+
     private:
-    TFTPServer* _tftpServer;
+    TFTPServerBase* _tftpServer;
+    ThreadTFTPStorage* _storage;
     Thread  _thread;
     int _cycleTime;
     void myThreadFn();
     bool _running;
     NetworkInterface* _network; 
     uint16_t _port;
+    MBED_ALIGN(8) unsigned char _stack[TFTP_SERVER_STACKSIZE];
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,133 @@
+/* 
+ * Copyright (c) 2019 
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "threadTFTPStorage.h"
+
+#define THREADNAME  "TFTPStorage"
+
+ThreadTFTPStorage::ThreadTFTPStorage(osPriority priority) :
+    _thread(priority, TFTP_IO_STACKSIZE, _stack, THREADNAME),
+    _pendingSem(0),
+    _completedSem(0),
+    _pendingHead(nullptr),
+    _pendingTail(nullptr),
+    _completedHead(nullptr),
+    _completedTail(nullptr),
+    _running(false)
+{
+}
+
+/*
+    start() : starts the thread
+*/
+void ThreadTFTPStorage::start()
+{
+    if(_running)
+        return;
+
+    _running = true;
+    _thread.start( callback(this, &ThreadTFTPStorage::myThreadFn) );
+}
+
+/*
+    submit() : queues a request
+*/
+void ThreadTFTPStorage::submit(IORequest* req)
+{
+    _mutex.lock();
+    put(&_pendingHead, &_pendingTail, req);
+    _mutex.unlock();
+    _pendingSem.release();
+}
+
+/*
+    getCompleted() : gets a finished request or nullptr
+*/
+TFTPServerBase::IORequest* ThreadTFTPStorage::getCompleted(uint32_t waitMs)
+{
+    bool available;
+
+    if(waitMs)
+        available = _completedSem.try_acquire_for(Kernel::Clock::duration_u32(waitMs));
+    else
+        available = _completedSem.try_acquire();
+
+    if(!available)
+        return nullptr;
+
+    _mutex.lock();
+    IORequest* req = get(&_completedHead, &_completedTail);
+    _mutex.unlock();
+    return req;
+}
+
+/*
+    put() : appends a request to a list, called with _mutex locked
+*/
+void ThreadTFTPStorage::put(IORequest** head, IORequest** tail, IORequest* req)
+{
+    req->next = nullptr;
+    if(*tail)
+        (*tail)->next = req;
+    else
+        *head = req;
+    *tail = req;
+}
+
+/*
+    get() : removes the first request from a list, called with _mutex locked
+*/
+TFTPServerBase::IORequest* ThreadTFTPStorage::get(IORequest** head, IORequest** tail)
+{
+    IORequest* req = *head;
+
+    if(req) {
+        *head = req->next;
+        if(*head == nullptr)
+            *tail = nullptr;
+    }
+    return req;
+}
+
+/*
+    myThreadFn() : executes requests in order
+*/
+void ThreadTFTPStorage::myThreadFn()
+{
+    while(_running) {
+        _pendingSem.acquire();
+
+        _mutex.lock();
+        IORequest* req = get(&_pendingHead, &_pendingTail);
+        _mutex.unlock();
+
+        if(req == nullptr)
+            continue;
+
+        TFTPServerBase::executeIO(req);
+
+        _mutex.lock();
+        put(&_completedHead, &_completedTail, req);
+        _mutex.unlock();
+        _completedSem.release();
+    }
+}
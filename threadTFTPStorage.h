@@ -0,0 +1,78 @@
+/* 
+ * Copyright (c) 2019 
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "mbed.h"
+#include "TFTPServer.h"
+
+#ifndef __threadTFTPStorage_h__
+#define __threadTFTPStorage_h__
+
+#ifndef TFTP_IO_STACKSIZE
+#define TFTP_IO_STACKSIZE       (3 * 1024)
+#endif
+
+/*
+    Executes storage requests of one TFTPServer in its own thread, so
+    fopen/fread/fwrite/fclose/remove never block the network loop.
+    Requests are linked through IORequest::next and complete in the
+    order they were submitted.
+*/
+class ThreadTFTPStorage
+{
+    public:
+    ThreadTFTPStorage(osPriority priority = osPriorityBelowNormal);
+
+    /*
+        start() : starts the thread
+    */
+    void start();
+
+    /*
+        submit() : queues a request
+    */
+    void submit(TFTPServerBase::IORequest* req);
+
+    /*
+        getCompleted() : gets a finished request or nullptr
+    */
+    TFTPServerBase::IORequest* getCompleted(uint32_t waitMs = 0);
+
+    private:
+    typedef TFTPServerBase::IORequest IORequest;
+
+    void put(IORequest** head, IORequest** tail, IORequest* req);
+    IORequest* get(IORequest** head, IORequest** tail);
+
+    Thread  _thread;
+    Mutex   _mutex;
+    Semaphore _pendingSem;
+    Semaphore _completedSem;
+    IORequest* _pendingHead;
+    IORequest* _pendingTail;
+    IORequest* _completedHead;
+    IORequest* _completedTail;
+    bool _running;
+    void myThreadFn();
+    MBED_ALIGN(8) unsigned char _stack[TFTP_IO_STACKSIZE];
+};
+
+#endif